@@ -0,0 +1,192 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Batch.h"
+#include "Function.h"
+#include "Parse.h"
+#include "VM.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+// Program compiled for the running thread
+struct BatchJob {
+    // Null if the program could not be compiled
+    std::unique_ptr<Function> function;
+    string error;
+};
+
+// Bounded queue of compiled programs, in the order they were read
+class BatchQueue {
+public:
+    BatchQueue(): closed(false) {
+    }
+
+    void push(BatchJob job) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return jobs.size() < BATCH_QUEUE_SIZE; });
+        jobs.push_back(std::move(job));
+        notEmpty.notify_one();
+    }
+
+    // No more programs follow
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_one();
+    }
+
+    // Take the next program, waiting for it at most timeout, or forever if
+    // timeout is zero. Return false if there is none.
+    bool pop(BatchJob &job, std::chrono::microseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto ready = [this] { return !jobs.empty() || closed; };
+        if(timeout.count())
+            notEmpty.wait_for(lock, timeout, ready);
+        else
+            notEmpty.wait(lock, ready);
+        if(jobs.empty())
+            return false;
+        job = std::move(jobs.front());
+        jobs.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::deque<BatchJob> jobs;
+    bool closed;
+};
+
+// Compile line as an expression, or as a script if it is none
+static BatchJob compileLine(const string &line)
+{
+    BatchJob job;
+    try {
+        std::unique_ptr<Function> function(new Function("main"));
+        if(parse(function.get(), ("return " + line).c_str())) {
+            job.function = std::move(function);
+            return job;
+        }
+        function.reset(new Function("main"));
+        if(parse(function.get(), line.c_str()))
+            job.function = std::move(function);
+        else
+            job.error = "syntax error";
+    }
+    catch(const char *msg) {
+        job.error = msg;
+    }
+    return job;
+}
+
+static BatchJob compileFile(const string &path)
+{
+    BatchJob job;
+    MappedSource source(path.c_str());
+    if(!source.isOpen()) {
+        job.error = "cannot open " + path;
+        return job;
+    }
+    try {
+        std::unique_ptr<Function> function(new Function("main"));
+        if(parse(function.get(), source))
+            job.function = std::move(function);
+        else
+            job.error = "syntax error";
+    }
+    catch(const char *msg) {
+        job.error = msg;
+    }
+    return job;
+}
+
+static void flush(string &buffer, FILE *out)
+{
+    fwrite(buffer.data(), 1, buffer.size(), out);
+    fflush(out);
+    buffer.clear();
+}
+
+// Run the programs of queue in order, return the count of failures
+static std::size_t run(BatchQueue &queue, FILE *out)
+{
+    VM vm;
+    vm.setTracing(false);
+    std::size_t failures = 0;
+    string buffer;
+    std::ostringstream os;
+    BatchJob job;
+    for(;;) {
+        // Results are written once no program follows shortly
+        if(!queue.pop(job, std::chrono::microseconds(BATCH_IDLE_TIME))) {
+            flush(buffer, out);
+            if(!queue.pop(job, std::chrono::microseconds(0)))
+                break;
+        }
+
+        os.str("");
+        if(job.function) {
+            try {
+                os << vm.call(job.function.get(), nullptr, 0);
+            }
+            catch(const char *msg) {
+                os.str("");
+                job.error = msg;
+            }
+            // Closures refer to the prototype, which is freed below
+            vm.reset();
+        }
+        if(!job.error.empty()) {
+            os << "error: " << job.error;
+            ++failures;
+        }
+        buffer += os.str();
+        buffer += '\n';
+        job.function.reset();
+
+        if(buffer.size() >= BATCH_BUFFER_SIZE)
+            flush(buffer, out);
+    }
+    return failures;
+}
+
+std::size_t runBatch(const std::vector<string> &files, std::istream &in, FILE *out)
+{
+    BatchQueue queue;
+    std::size_t failures = 0;
+    std::thread runner([&] {
+        failures = run(queue, out);
+    });
+
+    if(files.empty()) {
+        string line;
+        while(std::getline(in, line))
+            queue.push(compileLine(line));
+    }
+    for(auto &file : files)
+        queue.push(compileFile(file));
+
+    queue.close();
+    runner.join();
+    return failures;
+}
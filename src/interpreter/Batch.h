@@ -0,0 +1,43 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstdio>
+#include <istream>
+#include <string>
+#include <vector>
+
+// Compiled programs waiting to run
+#define BATCH_QUEUE_SIZE 256
+// Output bytes gathered before they are written
+#define BATCH_BUFFER_SIZE 65536
+// Microseconds without a program to run before the output is written
+#define BATCH_IDLE_TIME 1000
+
+// Evaluate many independent programs without interaction. Each program is
+// compiled on the calling thread while the ones before it run on a second
+// thread, with tracing off. One line is written to out per program: its
+// first result, nil if it returns none, or "error: " and a message.
+//
+// The programs are the given files, or else the lines of in. A line is
+// compiled as an expression if it is one, e.g. "2 * (3 + 4)", otherwise as
+// a script. Output is written in blocks, and whenever the running thread
+// is idle for a while, so that it also works as a line filter.
+// Return the count of programs which failed.
+std::size_t runBatch(const std::vector<std::string> &files, std::istream &in, FILE *out);
+
+#endif /* BATCH_H */
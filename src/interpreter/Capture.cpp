@@ -0,0 +1,97 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Capture.h"
+#include <algorithm>
+
+static const char magic[] = {'F', 'C', 'A', 'P', CAPTURE_VERSION};
+
+CaptureWriter::CaptureWriter(const char *path):os(path, std::ios::binary | std::ios::trunc)
+{
+    if(!os)
+        throw "Cannot create capture file";
+    os.write(magic, sizeof(magic));
+}
+
+void CaptureWriter::write(const CaptureRecord &record)
+{
+    writeVarint(record.source.size());
+    os.write(record.source.data(), record.source.size());
+    writeVarint(record.codes);
+    writeVarint(record.compileTime);
+    writeVarint(record.runTime);
+    os.put(record.valid ? 0 : 1);
+    // Keep the log usable if the process is killed
+    os.flush();
+}
+
+void CaptureWriter::writeVarint(std::uint64_t value)
+{
+    while(value >= 0x80) {
+        os.put(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    os.put(static_cast<char>(value));
+}
+
+CaptureReader::CaptureReader(const char *path):is(path, std::ios::binary)
+{
+    if(!is)
+        throw "Cannot open capture file";
+    char header[sizeof(magic)];
+    if(!is.read(header, sizeof(header)) || !std::equal(header, header + sizeof(header), magic))
+        throw "Invalid capture file";
+}
+
+bool CaptureReader::next(CaptureRecord &record)
+{
+    std::uint64_t length;
+    if(is.peek() == std::char_traits<char>::eof())
+        return false;
+    if(!readVarint(length))
+        throw "Truncated capture file";
+
+    record.source.resize(length);
+    if(length && !is.read(&record.source[0], length))
+        throw "Truncated capture file";
+    char flags;
+    if(!readVarint(record.codes) || !readVarint(record.compileTime) ||
+            !readVarint(record.runTime) || !is.get(flags))
+        throw "Truncated capture file";
+    record.valid = !(flags & 1);
+    return true;
+}
+
+bool CaptureReader::readVarint(std::uint64_t &value)
+{
+    value = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        char c;
+        if(!is.get(c))
+            return false;
+        value |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+        if(!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+std::uint64_t compiledSize(Function *function, std::size_t firstChild)
+{
+    std::uint64_t n = function->codeSize();
+    for(std::size_t i = firstChild; i < function->childCount(); ++i)
+        n += compiledSize(function->getChild(i));
+    return n;
+}
@@ -0,0 +1,76 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "Function.h"
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+// Workload captures: each submitted script or expression is logged with
+// its compiled size and the time taken to compile and to run it, so that
+// real formula mixes can be replayed against later builds.
+//
+// The file starts with the magic "FCAP" and a version byte, followed by
+// one record per submission. Integers are unsigned LEB128 varints:
+//     source length, source bytes, code count, compile ns, run ns, flags
+
+#define CAPTURE_VERSION 1
+
+struct CaptureRecord {
+    std::string source;
+    // Codes of the compiled function and of its nested functions
+    std::uint64_t codes;
+    // Wall times in nanoseconds
+    std::uint64_t compileTime;
+    std::uint64_t runTime;
+    // False if the source had syntax errors and was not run
+    bool valid;
+};
+
+class CaptureWriter {
+public:
+    // Create or truncate the capture file path
+    CaptureWriter(const char *path);
+
+    void write(const CaptureRecord &record);
+
+private:
+    void writeVarint(std::uint64_t value);
+
+    std::ofstream os;
+};
+
+class CaptureReader {
+public:
+    CaptureReader(const char *path);
+
+    // Read the next record, return false at the end of the file
+    bool next(CaptureRecord &record);
+
+private:
+    bool readVarint(std::uint64_t &value);
+
+    std::ifstream is;
+};
+
+// Count of codes of function and of its nested functions from child
+// firstChild on. The interpreter session keeps one main function, whose
+// earlier children belong to earlier programs.
+std::uint64_t compiledSize(Function *function, std::size_t firstChild = 0);
+
+#endif /* CAPTURE_H */
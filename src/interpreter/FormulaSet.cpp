@@ -0,0 +1,245 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "FormulaSet.h"
+#include "Parse.h"
+#include <thread>
+#include <atomic>
+
+FormulaSet::FormulaSet(int nthreads)
+{
+    if(nthreads <= 0)
+        nthreads = std::thread::hardware_concurrency();
+    if(nthreads <= 0)
+        nthreads = 1;
+    // Threads evaluate at once, none may write the trace to cout
+    for(int i = 0; i < nthreads; ++i) {
+        vms.push_back(std::unique_ptr<VM>(new VM()));
+        vms.back()->setTracing(false);
+    }
+}
+
+int FormulaSet::lookup(const string &name) const
+{
+    auto it = indexes.find(name);
+    return it == indexes.end() ? -1 : it->second;
+}
+
+int FormulaSet::add(const string &name)
+{
+    int i = lookup(name);
+    if(i != -1)
+        return i;
+    formulas.push_back(Formula(name));
+    indexes[name] = formulas.size() - 1;
+    return formulas.size() - 1;
+}
+
+// Compile source as a child of a scope holding every name as a local,
+// the names it refers to become its upvalues
+std::vector<int> FormulaSet::dependenciesOf(const string &name, const string &source)
+{
+    Function scope("formulas");
+    for(auto &formula: formulas)
+        scope.addLocalSymbolInfo(formula.name);
+    auto child = scope.getChild(scope.createChild(name));
+    if(!parse(child, source.c_str()))
+        throw "Invalid formula";
+
+    std::vector<int> dependencies;
+    for(int i = 0; i < child->upvalueCount(); ++i)
+        dependencies.push_back(child->getUpvalueInfo(i)->registerIndex);
+    return dependencies;
+}
+
+bool FormulaSet::reaches(int from, int to) const
+{
+    std::vector<bool> visited(formulas.size(), false);
+    std::vector<int> stack(1, from);
+    while(!stack.empty()) {
+        int i = stack.back();
+        stack.pop_back();
+        if(i == to)
+            return true;
+        if(visited[i])
+            continue;
+        visited[i] = true;
+        for(auto d: formulas[i].dependencies)
+            stack.push_back(d);
+    }
+    return false;
+}
+
+void FormulaSet::link(int i, const std::vector<int> &dependencies)
+{
+    formulas[i].dependencies = dependencies;
+    for(auto d: dependencies)
+        formulas[d].dependents.push_back(i);
+}
+
+void FormulaSet::unlink(int i)
+{
+    for(auto d: formulas[i].dependencies) {
+        auto &dependents = formulas[d].dependents;
+        for(std::size_t k = 0; k < dependents.size(); ++k) {
+            if(dependents[k] == i) {
+                dependents.erase(dependents.begin() + k);
+                break;
+            }
+        }
+    }
+    formulas[i].dependencies.clear();
+}
+
+void FormulaSet::markDependents(int i)
+{
+    std::vector<int> stack(formulas[i].dependents);
+    while(!stack.empty()) {
+        int d = stack.back();
+        stack.pop_back();
+        if(formulas[d].dirty)
+            continue;
+        formulas[d].dirty = true;
+        stack.insert(stack.end(), formulas[d].dependents.begin(), formulas[d].dependents.end());
+    }
+}
+
+void FormulaSet::define(const string &name, const string &expression)
+{
+    string source = "return " + expression;
+    auto dependencies = dependenciesOf(name, source);
+    int i = lookup(name);
+    if(i != -1) {
+        for(auto d: dependencies)
+            if(reaches(d, i))
+                throw "Cyclic formula dependency";
+    }
+
+    // Dependencies are passed as arguments, in the order of the upvalues
+    std::unique_ptr<Function> function(new Function(name));
+    for(std::size_t k = 0; k < dependencies.size(); ++k)
+        function->addParam(LocalSymbolInfo(formulas[dependencies[k]].name, k));
+    if(!parse(function.get(), source.c_str()))
+        throw "Invalid formula";
+    function->freeze();
+
+    i = add(name);
+    unlink(i);
+    link(i, dependencies);
+    formulas[i].function = function.get();
+    formulas[i].dirty = true;
+    functions.push_back(std::move(function));
+    markDependents(i);
+}
+
+void FormulaSet::set(const string &name, const Operand &value)
+{
+    int i = add(name);
+    unlink(i);
+    formulas[i].function = nullptr;
+    formulas[i].value = value;
+    formulas[i].error = nullptr;
+    formulas[i].dirty = false;
+    markDependents(i);
+}
+
+void FormulaSet::evaluate(int i, VM &vm)
+{
+    auto &formula = formulas[i];
+    std::vector<Operand> args;
+    for(auto d: formula.dependencies)
+        args.push_back(formulas[d].value);
+    try {
+        formula.value = vm.call(formula.function, args.data(), args.size());
+        formula.error = nullptr;
+    }
+    catch(const char *msg) {
+        formula.value = Operand();
+        formula.error = msg;
+    }
+    formula.dirty = false;
+}
+
+// Each thread takes the next formula of the level until none is left,
+// the formulas only read values of lower levels
+void FormulaSet::evaluateLevel(const std::vector<int> &level)
+{
+    std::size_t nthreads = vms.size() < level.size() ? vms.size() : level.size();
+    if(nthreads <= 1) {
+        for(auto i: level)
+            evaluate(i, *vms[0]);
+        return;
+    }
+
+    std::atomic<std::size_t> next(0);
+    std::vector<std::thread> threads;
+    for(std::size_t t = 0; t < nthreads; ++t) {
+        threads.push_back(std::thread([this, &level, &next, t]() {
+            for(std::size_t k = next++; k < level.size(); k = next++)
+                evaluate(level[k], *vms[t]);
+        }));
+    }
+    for(auto &thread: threads)
+        thread.join();
+}
+
+// Levels are found like Kahn's topological sort: a dirty formula joins
+// the level after its last dirty dependency was evaluated
+int FormulaSet::recalculate()
+{
+    int n = formulas.size();
+    std::vector<int> pending(n, 0);
+    std::vector<int> level;
+    for(int i = 0; i < n; ++i) {
+        if(!formulas[i].dirty)
+            continue;
+        for(auto d: formulas[i].dependencies)
+            if(formulas[d].dirty)
+                ++pending[i];
+        if(pending[i] == 0)
+            level.push_back(i);
+    }
+
+    int count = 0;
+    while(!level.empty()) {
+        evaluateLevel(level);
+        count += level.size();
+        std::vector<int> next;
+        for(auto i: level)
+            for(auto d: formulas[i].dependents)
+                if(--pending[d] == 0)
+                    next.push_back(d);
+        level.swap(next);
+    }
+    return count;
+}
+
+Operand FormulaSet::get(const string &name)
+{
+    int i = lookup(name);
+    if(i == -1)
+        throw "Undefined formula";
+    if(formulas[i].dirty)
+        recalculate();
+    return formulas[i].value;
+}
+
+const char *FormulaSet::getError(const string &name) const
+{
+    int i = lookup(name);
+    if(i == -1)
+        throw "Undefined formula";
+    return formulas[i].error;
+}
@@ -0,0 +1,94 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FORMULASET_H
+#define FORMULASET_H
+
+#include "Function.h"
+#include "Operand.h"
+#include "VM.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+// Set of named formulas over named inputs. Formulas refer to inputs and to
+// other formulas by name, these references form a dependency graph. Results
+// are cached: after a change only the formulas depending on it are
+// evaluated again, in topological order. Formulas at the same depth of the
+// graph never depend on each other and are evaluated in parallel.
+class FormulaSet {
+public:
+    // Evaluate with nthreads threads, one per hardware thread if zero
+    FormulaSet(int nthreads = 0);
+
+    FormulaSet(const FormulaSet &) = delete;
+    FormulaSet & operator = (const FormulaSet &) = delete;
+
+    // Define or redefine formula name as expression, e.g. "a * b + 1".
+    // Names in expression must be defined already, or be builtins.
+    void define(const string &name, const string &expression);
+    // Set input name to value, a formula of this name becomes an input
+    void set(const string &name, const Operand &value);
+    // Evaluate the formulas whose dependencies changed, return their count
+    int recalculate();
+    // Value of name after recalculating, nil if its evaluation failed
+    Operand get(const string &name);
+    // Error message of the last evaluation of name, null if it succeeded
+    const char *getError(const string &name) const;
+
+private:
+    struct Formula {
+        string name;
+        // Prototype taking the values of dependencies as arguments,
+        // null for inputs
+        Function *function;
+        std::vector<int> dependencies;
+        std::vector<int> dependents;
+        Operand value;
+        const char *error;
+        // Value is out of date
+        bool dirty;
+
+        Formula(const string &name): name(name), function(nullptr), error(nullptr),
+            dirty(false) {
+        }
+    };
+
+    // Index of formula or input name, -1 if undefined
+    int lookup(const string &name) const;
+    int add(const string &name);
+    // Indexes of the names expression refers to
+    std::vector<int> dependenciesOf(const string &name, const string &source);
+    // Whether formula to is reachable from formula from through dependencies
+    bool reaches(int from, int to) const;
+    void link(int i, const std::vector<int> &dependencies);
+    void unlink(int i);
+    // Mark dependents of formula i and their dependents out of date
+    void markDependents(int i);
+    void evaluate(int i, VM &vm);
+    // Evaluate formulas of one level, in parallel when there are several
+    void evaluateLevel(const std::vector<int> &level);
+
+    std::vector<Formula> formulas;
+    std::unordered_map<string, int> indexes;
+    // Compiled prototypes, frozen and kept while machines may hold their
+    // closures
+    std::vector<std::unique_ptr<Function>> functions;
+    // One machine per thread, values they created stay valid
+    std::vector<std::unique_ptr<VM>> vms;
+};
+
+#endif /* FORMULASET_H */
@@ -0,0 +1,184 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Parse.h"
+#include "parser.h"
+#include "lexer.h"
+#include "Optimizer.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int yyparse(Function * function, void *scanner);
+
+// First line of the lexer input
+extern int firstRow;
+
+bool parse(Function *function, const char *expr)
+{
+    yyscan_t scanner;
+    YY_BUFFER_STATE state;
+
+    if (yylex_init(&scanner)) {
+        // couldn't initialize
+        return false;
+    }
+
+    state = yy_scan_string(expr, scanner);
+
+    bool ok = yyparse(function, scanner) == 0;
+
+    yy_delete_buffer(state, scanner);
+
+    yylex_destroy(scanner);
+
+    if (!ok) {
+        // error parsing
+        return false;
+    }
+
+    optimize(function);
+
+    return true;
+}
+
+bool parse(Function *function, FILE *fp)
+{
+    yyscan_t scanner;
+    YY_BUFFER_STATE state;
+
+    if (yylex_init(&scanner)) {
+        // couldn't initialize
+        return false;
+    }
+
+    if(!fp) fp = stdin;
+    state = yy_create_buffer(fp, YY_BUF_SIZE, scanner);
+    yy_switch_to_buffer(state, scanner);
+
+    bool lazy = function->isLazy();
+    function->setLazy(false);
+    bool ok = yyparse(function, scanner) == 0;
+    function->setLazy(lazy);
+
+    yy_delete_buffer(state, scanner);
+
+    yylex_destroy(scanner);
+
+    if (!ok) {
+        // error parsing
+        return false;
+    }
+
+    optimize(function);
+
+    return true;
+}
+
+bool compileDeferred(Function *function)
+{
+    yyscan_t scanner;
+    YY_BUFFER_STATE state;
+
+    string body = function->takeDeferredBody();
+    if (body.empty() || yylex_init(&scanner)) {
+        return false;
+    }
+
+    function->clearCodes();
+    state = yy_scan_bytes(body.data(), body.size(), scanner);
+
+    // Lines are counted from the line the body starts at
+    firstRow = function->getDeferredLine();
+    bool ok = yyparse(function, scanner) == 0;
+    firstRow = 1;
+
+    yy_delete_buffer(state, scanner);
+
+    yylex_destroy(scanner);
+
+    if (!ok) {
+        // Codes of the failed parse are replaced, the function stays
+        // deferred and calls of it fail
+        function->clearCodes();
+        function->addCode(Code(Code::Return, 0, 0, 0), function->getDeferredLine());
+        function->setOptimized();
+        return false;
+    }
+
+    function->setCompiled();
+    optimize(function);
+
+    return true;
+}
+
+MappedSource::MappedSource(const char *path): base(nullptr), length(0)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return;
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        // Zero pages reserve room for the NULs, then the file is mapped
+        // over them. The rest of its last page reads as zero too.
+        std::size_t size = st.st_size;
+        void *p = mmap(nullptr, size + 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if(p != MAP_FAILED) {
+            if(size == 0 || mmap(p, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+                base = static_cast<char *>(p);
+                length = size + 2;
+            } else {
+                munmap(p, size + 2);
+            }
+        }
+    }
+    close(fd);
+}
+
+MappedSource::~MappedSource()
+{
+    if(base)
+        munmap(base, length);
+}
+
+bool parse(Function *function, MappedSource &source)
+{
+    yyscan_t scanner;
+    YY_BUFFER_STATE state;
+
+    if (!source.isOpen() || yylex_init(&scanner)) {
+        // couldn't initialize
+        return false;
+    }
+
+    state = yy_scan_buffer(source.data(), source.size(), scanner);
+
+    bool ok = state && yyparse(function, scanner) == 0;
+
+    if (state)
+        yy_delete_buffer(state, scanner);
+
+    yylex_destroy(scanner);
+
+    if (!ok) {
+        // error parsing
+        return false;
+    }
+
+    optimize(function);
+
+    return true;
+}
@@ -0,0 +1,68 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PARSE_H
+#define PARSE_H
+
+#include "Function.h"
+#include <stdio.h>
+#include <cstddef>
+
+// Parse source text expr into function and optimize it, return false
+// on syntax errors
+bool parse(Function *function, const char *expr);
+
+// Parse source file fp(stdin if null) into function and optimize it,
+// return false on syntax errors. Bodies are never deferred, since the
+// lexer buffer is refilled while they are skipped.
+bool parse(Function *function, FILE *fp);
+
+// Compile the deferred body of function and optimize it, return false on
+// syntax errors. A body failing once is not compiled again.
+bool compileDeferred(Function *function);
+
+// Source file mapped into memory, followed by the two NULs the lexer needs
+// to scan it in place. Pages are private, only those the lexer writes its
+// terminators to are copied.
+class MappedSource {
+public:
+    MappedSource(const char *path);
+    ~MappedSource();
+
+    MappedSource(const MappedSource &) = delete;
+    MappedSource & operator = (const MappedSource &) = delete;
+
+    // False if the file could not be mapped
+    bool isOpen() const {
+        return base != nullptr;
+    }
+    char *data() {
+        return base;
+    }
+    // Size of the file and the two NULs
+    std::size_t size() const {
+        return length;
+    }
+
+private:
+    char *base;
+    std::size_t length;
+};
+
+// Parse mapped source in place, without copying it, into function and
+// optimize it, return false on syntax errors. The source is modified.
+bool parse(Function *function, MappedSource &source);
+
+#endif /* PARSE_H */
@@ -0,0 +1,161 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Allocator.h"
+#include <new>
+#include <algorithm>
+
+// Object sizes of the size classes, multiples of 16 bytes
+static const std::size_t sizeClasses[] = {16, 32, 48, 64, 96, 128, 192, 256};
+static const int sizeClassCount = sizeof(sizeClasses) / sizeof(sizeClasses[0]);
+
+Allocator::Allocator()
+{
+    for(int i = 0; i < sizeClassCount; ++i) {
+        SizeClass c;
+        c.size = sizeClasses[i];
+        c.freeList = nullptr;
+        c.cursor = nullptr;
+        c.limit = nullptr;
+        c.allocations = 0;
+        classes.push_back(c);
+    }
+}
+
+int Allocator::sizeClassIndex(std::size_t size)
+{
+    for(int i = 0; i < sizeClassCount; ++i)
+        if(size <= sizeClasses[i])
+            return i;
+    return -1;
+}
+
+void Allocator::newSlab(SizeClass &c)
+{
+    char *slab = static_cast<char *>(::operator new(SLAB_SIZE));
+    slabs.push_back(slab);
+    stats.slabs++;
+    c.cursor = slab;
+    c.limit = slab + SLAB_SIZE - SLAB_SIZE % c.size;
+}
+
+void *Allocator::allocate(std::size_t size)
+{
+    stats.allocations++;
+    int i = sizeClassIndex(size);
+    void *p;
+    if(i == -1) {
+        p = ::operator new(size);
+        large.push_back(p);
+        stats.largeAllocations++;
+        stats.liveBytes += size;
+    } else {
+        SizeClass &c = classes[i];
+        c.allocations++;
+        if(c.freeList) {
+            p = c.freeList;
+            c.freeList = c.freeList->next;
+            stats.reuses++;
+        } else {
+            if(c.cursor == c.limit)
+                newSlab(c);
+            p = c.cursor;
+            c.cursor += c.size;
+        }
+        stats.liveBytes += c.size;
+    }
+    stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+    return p;
+}
+
+void Allocator::deallocate(void *p, std::size_t size)
+{
+    if(!p) return;
+    stats.deallocations++;
+    int i = sizeClassIndex(size);
+    if(i == -1) {
+        auto it = std::find(large.begin(), large.end(), p);
+        if(it == large.end())
+            throw "Deallocate memory not owned by allocator";
+        large.erase(it);
+        ::operator delete(p);
+        stats.liveBytes -= size;
+    } else {
+        SizeClass &c = classes[i];
+        auto node = static_cast<FreeNode *>(p);
+        node->next = c.freeList;
+        c.freeList = node;
+        stats.liveBytes -= c.size;
+    }
+}
+
+void Allocator::reset()
+{
+    for(auto slab : slabs)
+        ::operator delete(slab);
+    for(auto p : large)
+        ::operator delete(p);
+    slabs.clear();
+    large.clear();
+    for(auto &c : classes) {
+        c.freeList = nullptr;
+        c.cursor = nullptr;
+        c.limit = nullptr;
+    }
+    stats.liveBytes = 0;
+}
+
+ostream & operator <<(ostream & os, const Allocator & a)
+{
+    const Allocator::Stats &s = a.stats;
+    os << "allocations: " << s.allocations
+       << ", deallocations: " << s.deallocations
+       << ", reuses: " << s.reuses
+       << ", large: " << s.largeAllocations << std::endl;
+    os << "live bytes: " << s.liveBytes
+       << ", peak bytes: " << s.peakBytes
+       << ", slabs: " << s.slabs << " (" << s.slabs * SLAB_SIZE << " bytes)" << std::endl;
+    for(auto &c : a.classes) {
+        if(c.allocations)
+            os << "\t" << c.size << " bytes\t" << c.allocations << " allocations" << std::endl;
+    }
+    return os;
+}
+
+void *StackAllocator::allocate(std::size_t size)
+{
+    if(size > SLAB_SIZE)
+        throw "Frame storage too large";
+    // Keep every allocation 16 bytes aligned
+    size = (size + 15) & ~std::size_t(15);
+    if(offset + size > SLAB_SIZE) {
+        current++;
+        offset = 0;
+    }
+    if(current == chunks.size())
+        chunks.push_back(static_cast<char *>(::operator new(SLAB_SIZE)));
+    void *p = chunks[current] + offset;
+    offset += size;
+    return p;
+}
+
+void StackAllocator::reset()
+{
+    for(auto chunk : chunks)
+        ::operator delete(chunk);
+    chunks.clear();
+    current = 0;
+    offset = 0;
+}
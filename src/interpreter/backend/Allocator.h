@@ -0,0 +1,150 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <cstddef>
+#include <vector>
+#include <iostream>
+using std::ostream;
+
+#define SLAB_SIZE 16384
+
+// Size-class slab allocator for runtime objects (closures, upvalues, ...).
+// Each size class carves objects from contiguous slabs and recycles freed
+// objects through a free list. All memory is released at once by reset()
+// or when the allocator is destroyed.
+class Allocator {
+public:
+    // Allocation statistics
+    struct Stats {
+        // Count of allocate() calls
+        std::size_t allocations;
+        // Count of deallocate() calls
+        std::size_t deallocations;
+        // Allocations served from a free list
+        std::size_t reuses;
+        // Bytes currently handed out (rounded to size class)
+        std::size_t liveBytes;
+        // Maximum of liveBytes
+        std::size_t peakBytes;
+        // Slabs allocated from the system
+        std::size_t slabs;
+        // Allocations too large for any size class
+        std::size_t largeAllocations;
+
+        Stats(): allocations(0), deallocations(0), reuses(0), liveBytes(0),
+            peakBytes(0), slabs(0), largeAllocations(0) {
+        }
+    };
+
+    Allocator();
+    ~Allocator() {
+        reset();
+    }
+
+    Allocator(const Allocator &) = delete;
+    Allocator & operator = (const Allocator &) = delete;
+
+    // Allocate size bytes, aligned for any runtime object
+    void *allocate(std::size_t size);
+    // Return memory obtained by allocate(size) to its size class
+    void deallocate(void *p, std::size_t size);
+    // Release all slabs at once, every object allocated before is invalid
+    void reset();
+
+    const Stats &getStats() const {
+        return stats;
+    }
+
+    friend ostream & operator <<(ostream & os, const Allocator & a);
+
+private:
+    struct FreeNode {
+        FreeNode *next;
+    };
+
+    struct SizeClass {
+        // Object size of this class
+        std::size_t size;
+        // Recycled objects
+        FreeNode *freeList;
+        // Unused space of the current slab
+        char *cursor;
+        char *limit;
+        // Allocations of this class
+        std::size_t allocations;
+    };
+
+    // Index of the smallest size class holding size bytes, -1 if none
+    static int sizeClassIndex(std::size_t size);
+    // Refill the current slab of size class c
+    void newSlab(SizeClass &c);
+
+    std::vector<SizeClass> classes;
+    // Slabs of all size classes
+    std::vector<char *> slabs;
+    // Objects larger than the biggest size class
+    std::vector<void *> large;
+    Stats stats;
+};
+
+// Stack allocator of frame storage. Memory is released in LIFO order by
+// rewinding to a mark, chunks are kept for reuse by later frames.
+class StackAllocator {
+public:
+    // Position in the stack
+    struct Mark {
+        std::size_t chunk;
+        std::size_t offset;
+
+        Mark(): chunk(0), offset(0) {}
+        Mark(std::size_t chunk, std::size_t offset): chunk(chunk), offset(offset) {}
+    };
+
+    StackAllocator(): current(0), offset(0) {
+    }
+    ~StackAllocator() {
+        reset();
+    }
+
+    StackAllocator(const StackAllocator &) = delete;
+    StackAllocator & operator = (const StackAllocator &) = delete;
+
+    // Allocate size bytes on top of the stack, size is at most SLAB_SIZE
+    void *allocate(std::size_t size);
+
+    Mark mark() const {
+        return Mark(current, offset);
+    }
+
+    // Release all memory allocated after mark m
+    void release(const Mark &m) {
+        current = m.chunk;
+        offset = m.offset;
+    }
+
+    // Free all chunks
+    void reset();
+
+private:
+    std::vector<char *> chunks;
+    // Chunk being filled and its used bytes
+    std::size_t current;
+    std::size_t offset;
+};
+
+#endif /* ALLOCATOR_H */
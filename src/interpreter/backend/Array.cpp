@@ -0,0 +1,91 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Array.h"
+#include <new>
+#include <cstring>
+
+// Elements printed before the rest is elided
+#define ARRAY_PRINT_LIMIT 8
+
+Array *Array::create(Operand::OperandType type, int length, Allocator &allocator)
+{
+    if(type != Operand::IntegerType && type != Operand::RealType)
+        throw "Invalid element type of array";
+    if(length < 0)
+        throw "Negative length of array";
+    auto array = new(allocator.allocate(allocationSize(type, length))) Array(type, length);
+    std::memset(static_cast<void *>(array + 1), 0, allocationSize(type, length) - sizeof(Array));
+    return array;
+}
+
+void Array::destroy(Array *array, Allocator &allocator)
+{
+    auto size = allocationSize(array->type, array->length);
+    array->~Array();
+    allocator.deallocate(array, size);
+}
+
+int Array::position(const Operand &key) const
+{
+    if(key.type != Operand::IntegerType)
+        throw "Invalid index type of array";
+    if(key.integer < 1 || key.integer > length)
+        throw "Array index out of bounds";
+    return key.integer - 1;
+}
+
+Operand Array::get(const Operand &key) const
+{
+    int i = position(key);
+    if(type == Operand::RealType)
+        return Operand(reals()[i]);
+    return Operand(integers()[i]);
+}
+
+void Array::set(const Operand &key, const Operand &value)
+{
+    int i = position(key);
+    if(value.type == Operand::IntegerType) {
+        if(type == Operand::RealType)
+            reals()[i] = value.integer;
+        else
+            integers()[i] = value.integer;
+    } else if(value.type == Operand::RealType && type == Operand::RealType) {
+        reals()[i] = value.real;
+    } else {
+        throw "Invalid value type in array assignment";
+    }
+}
+
+ostream & operator <<(ostream & os, const Array & a)
+{
+    os << "[";
+    for(int i = 0; i < a.length; ++i) {
+        if(i == ARRAY_PRINT_LIMIT) {
+            os << ", ... (" << a.length << ")";
+            break;
+        }
+        if(i != 0)
+            os << ", ";
+        if(a.type == Operand::RealType)
+            os << a.reals()[i];
+        else
+            os << a.integers()[i];
+    }
+    os << "]";
+    return os;
+}
@@ -0,0 +1,93 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include "Operand.h"
+#include "Allocator.h"
+
+// Dense numeric array, a header followed by its elements in one contiguous
+// allocation. Elements are all integers or all reals, indexes start at 1.
+class Array {
+public:
+    // Allocate array of length elements of type (IntegerType or RealType),
+    // all elements are zero
+    static Array *create(Operand::OperandType type, int length, Allocator &allocator);
+    // Deallocate array created by create()
+    static void destroy(Array *array, Allocator &allocator);
+
+    Array(const Array &) = delete;
+    Array & operator = (const Array &) = delete;
+
+    Operand::OperandType getType() const {
+        return type;
+    }
+
+    int getLength() const {
+        return length;
+    }
+
+    // Element storage, valid for the type of the array only
+    int *integers() {
+        return reinterpret_cast<int *>(this + 1);
+    }
+
+    const int *integers() const {
+        return reinterpret_cast<const int *>(this + 1);
+    }
+
+    double *reals() {
+        return reinterpret_cast<double *>(this + 1);
+    }
+
+    const double *reals() const {
+        return reinterpret_cast<const double *>(this + 1);
+    }
+
+    // Element at key with bounds check
+    Operand get(const Operand &key) const;
+    // Set element at key with bounds check, integers are converted
+    // when stored into real array
+    void set(const Operand &key, const Operand &value);
+
+    // Element i (0-based) as real
+    double realAt(int i) const {
+        return type == Operand::RealType ? reals()[i] : integers()[i];
+    }
+
+    // Size in bytes of an array of length elements of type
+    static std::size_t allocationSize(Operand::OperandType type, int length) {
+        return sizeof(Array) + length * (type == Operand::RealType ? sizeof(double) : sizeof(int));
+    }
+
+    friend ostream & operator <<(ostream & os, const Array & a);
+
+private:
+    Array(Operand::OperandType type, int length)
+        :type(type), length(length) {
+    }
+
+    // 0-based position of key, throws when out of bounds
+    int position(const Operand &key) const;
+
+    // Type of elements
+    Operand::OperandType type;
+    // Count of elements
+    int length;
+};
+
+#endif /* ARRAY_H */
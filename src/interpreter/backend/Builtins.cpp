@@ -0,0 +1,480 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Builtins.h"
+#include "VM.h"
+#include "Dual.h"
+#include <cmath>
+#include <utility>
+#include <algorithm>
+#include <vector>
+
+// Numeric value of argument a
+static double number(const Operand &a)
+{
+    switch(a.type) {
+    case Operand::IntegerType:
+        return a.integer;
+    case Operand::RealType:
+        return a.real;
+    case Operand::DualType:
+        return a.dual->getValue();
+    default:
+        throw "Invalid argument type in builtin function";
+    }
+}
+
+static void checkCount(int nargs, int expected)
+{
+    if(nargs != expected)
+        throw "Wrong number of arguments in builtin function";
+}
+
+static bool dual(const Operand &a)
+{
+    return a.type == Operand::DualType;
+}
+
+// Builtins of one real argument, slope is the derivative at x
+#define UNARY(name, expr, slope) \
+    static Operand name(VM &, const Operand *args, int nargs) \
+    { \
+        checkCount(nargs, 1); \
+        double x = number(args[0]); \
+        if(dual(args[0])) \
+            return dualApply(args[0], expr, slope); \
+        return Operand(double(expr)); \
+    }
+
+UNARY(mathSqrt, std::sqrt(x), 0.5 / std::sqrt(x))
+UNARY(mathExp, std::exp(x), std::exp(x))
+UNARY(mathLog10, std::log10(x), 1 / (x * std::log(10.0)))
+UNARY(mathSin, std::sin(x), std::cos(x))
+UNARY(mathCos, std::cos(x), -std::sin(x))
+UNARY(mathTan, std::tan(x), 1 / (std::cos(x) * std::cos(x)))
+UNARY(mathAsin, std::asin(x), 1 / std::sqrt(1 - x * x))
+UNARY(mathAcos, std::acos(x), -1 / std::sqrt(1 - x * x))
+UNARY(mathSinh, std::sinh(x), std::cosh(x))
+UNARY(mathCosh, std::cosh(x), std::sinh(x))
+UNARY(mathTanh, std::tanh(x), 1 - std::tanh(x) * std::tanh(x))
+
+// Rounding keeps integers as they are. The derivative is zero almost
+// everywhere, so dual numbers are rounded to reals.
+#define ROUNDING(name, expr) \
+    static Operand name(VM &, const Operand *args, int nargs) \
+    { \
+        checkCount(nargs, 1); \
+        if(args[0].type == Operand::IntegerType) \
+            return args[0]; \
+        double x = number(args[0]); \
+        return Operand(double(expr)); \
+    }
+
+ROUNDING(mathFloor, std::floor(x))
+ROUNDING(mathCeil, std::ceil(x))
+ROUNDING(mathRound, std::round(x))
+
+static Operand mathAbs(VM &, const Operand *args, int nargs)
+{
+    checkCount(nargs, 1);
+    if(args[0].type == Operand::IntegerType)
+        return Operand(args[0].integer < 0 ? -args[0].integer : args[0].integer);
+    double x = number(args[0]);
+    if(dual(args[0]))
+        return dualApply(args[0], std::fabs(x), x < 0 ? -1 : 1);
+    return Operand(std::fabs(x));
+}
+
+// log(x) is the natural logarithm, log(x, b) the logarithm to base b
+static Operand mathLog(VM &, const Operand *args, int nargs)
+{
+    if(nargs == 2) {
+        double x = number(args[0]), b = number(args[1]);
+        double value = std::log(x) / std::log(b);
+        if(dual(args[0]) || dual(args[1]))
+            return dualApply(args[0], args[1], value, 1 / (x * std::log(b)), -value / (b * std::log(b)));
+        return Operand(value);
+    }
+    checkCount(nargs, 1);
+    double x = number(args[0]);
+    if(dual(args[0]))
+        return dualApply(args[0], std::log(x), 1 / x);
+    return Operand(std::log(x));
+}
+
+// atan(y) or atan(y, x) for the angle of point (x, y)
+static Operand mathAtan(VM &, const Operand *args, int nargs)
+{
+    if(nargs == 2) {
+        double y = number(args[0]), x = number(args[1]);
+        if(dual(args[0]) || dual(args[1]))
+            return dualApply(args[0], args[1], std::atan2(y, x), x / (x * x + y * y), -y / (x * x + y * y));
+        return Operand(std::atan2(y, x));
+    }
+    checkCount(nargs, 1);
+    double y = number(args[0]);
+    if(dual(args[0]))
+        return dualApply(args[0], std::atan(y), 1 / (1 + y * y));
+    return Operand(std::atan(y));
+}
+
+static Operand mathHypot(VM &, const Operand *args, int nargs)
+{
+    checkCount(nargs, 2);
+    double x = number(args[0]), y = number(args[1]);
+    double h = std::hypot(x, y);
+    if(dual(args[0]) || dual(args[1]))
+        return dualApply(args[0], args[1], h, x / h, y / h);
+    return Operand(h);
+}
+
+static Operand mathFmod(VM &, const Operand *args, int nargs)
+{
+    checkCount(nargs, 2);
+    double x = number(args[0]), y = number(args[1]);
+    if(dual(args[0]) || dual(args[1]))
+        return dualApply(args[0], args[1], std::fmod(x, y), 1, -std::trunc(x / y));
+    return Operand(std::fmod(x, y));
+}
+
+// Smallest or largest of one or more numbers, the argument is returned
+// as it is
+static Operand mathMin(VM &, const Operand *args, int nargs)
+{
+    if(nargs < 1)
+        throw "Wrong number of arguments in builtin function";
+    int k = 0;
+    number(args[0]);
+    for(int i = 1; i < nargs; ++i)
+        if(number(args[i]) < number(args[k]))
+            k = i;
+    return args[k];
+}
+
+static Operand mathMax(VM &, const Operand *args, int nargs)
+{
+    if(nargs < 1)
+        throw "Wrong number of arguments in builtin function";
+    int k = 0;
+    number(args[0]);
+    for(int i = 1; i < nargs; ++i)
+        if(number(args[i]) > number(args[k]))
+            k = i;
+    return args[k];
+}
+
+// Value of f(x), f given to a builtin as a callback
+static double evaluate(VM &vm, const Callback &f, double x)
+{
+    Operand arg(x);
+    auto value = vm.callback(f, &arg, 1);
+    switch(value.type) {
+    case Operand::IntegerType:
+        return value.integer;
+    case Operand::RealType:
+        return value.real;
+    default:
+        throw "Invalid result type of function in builtin function";
+    }
+}
+
+#define SOLVER_ITERATIONS 200
+
+// solve(f, a, b[, tolerance]) finds a root of f between a and b, where f
+// changes its sign. Regula falsi with the Illinois modification.
+static Operand solve(VM &vm, const Operand *args, int nargs)
+{
+    if(nargs != 3 && nargs != 4)
+        throw "Wrong number of arguments in builtin function";
+    double a = number(args[1]), b = number(args[2]);
+    double tolerance = nargs == 4 ? number(args[3]) : 1e-12;
+    auto f = vm.prepareCallback(args[0], 1);
+
+    double fa = evaluate(vm, f, a), fb = evaluate(vm, f, b);
+    if(fa == 0)
+        return Operand(a);
+    if(fb == 0)
+        return Operand(b);
+    if((fa < 0) == (fb < 0))
+        throw "No sign change of function in solve";
+
+    int side = 0;
+    double x = a;
+    for(int i = 0; i < SOLVER_ITERATIONS; ++i) {
+        x = (a * fb - b * fa) / (fb - fa);
+        if(std::fabs(b - a) <= tolerance * (1 + std::fabs(x)))
+            break;
+        double fx = evaluate(vm, f, x);
+        if(fx == 0)
+            break;
+        // Halve the value of an end kept twice in a row
+        if((fx < 0) == (fb < 0)) {
+            b = x;
+            fb = fx;
+            if(side == -1)
+                fa /= 2;
+            side = -1;
+        } else {
+            a = x;
+            fa = fx;
+            if(side == 1)
+                fb /= 2;
+            side = 1;
+        }
+    }
+    return Operand(x);
+}
+
+// integrate(f, a, b[, n]) integrates f from a to b by Simpson's rule
+// over n intervals, 100 by default
+static Operand integrate(VM &vm, const Operand *args, int nargs)
+{
+    if(nargs != 3 && nargs != 4)
+        throw "Wrong number of arguments in builtin function";
+    double a = number(args[1]), b = number(args[2]);
+    int n = nargs == 4 ? (int)number(args[3]) : 100;
+    if(n < 2)
+        n = 2;
+    n += n % 2;
+    auto f = vm.prepareCallback(args[0], 1);
+
+    double h = (b - a) / n;
+    double sum = evaluate(vm, f, a) + evaluate(vm, f, b);
+    for(int i = 1; i < n; ++i)
+        sum += (i % 2 ? 4 : 2) * evaluate(vm, f, a + i * h);
+    return Operand(sum * h / 3);
+}
+
+// minimize(f, x0[, step]) finds a local minimum of f downhill from x0.
+// The minimum is bracketed by growing steps, then narrowed by golden
+// section search.
+static Operand minimize(VM &vm, const Operand *args, int nargs)
+{
+    if(nargs != 2 && nargs != 3)
+        throw "Wrong number of arguments in builtin function";
+    double a = number(args[1]);
+    double step = nargs == 3 ? number(args[2]) : 0.1 * (1 + std::fabs(a));
+    auto f = vm.prepareCallback(args[0], 1);
+    const double golden = 0.5 * (std::sqrt(5.0) - 1);
+
+    double fa = evaluate(vm, f, a);
+    double b = a + step, fb = evaluate(vm, f, b);
+    if(fb > fa) {
+        std::swap(a, b);
+        std::swap(fa, fb);
+        step = -step;
+    }
+    double c = b + step, fc = evaluate(vm, f, c);
+    for(int i = 0; fc < fb && i < SOLVER_ITERATIONS; ++i) {
+        a = b;
+        b = c;
+        fb = fc;
+        step /= golden;
+        c = b + step;
+        fc = evaluate(vm, f, c);
+    }
+
+    // The minimum is between a and c, b is inside
+    double x1 = c - golden * (c - a), x2 = a + golden * (c - a);
+    double f1 = evaluate(vm, f, x1), f2 = evaluate(vm, f, x2);
+    for(int i = 0; i < SOLVER_ITERATIONS && std::fabs(c - a) > 1e-10 * (1 + std::fabs(x1)); ++i) {
+        if(f1 < f2) {
+            c = x2;
+            x2 = x1;
+            f2 = f1;
+            x1 = c - golden * (c - a);
+            f1 = evaluate(vm, f, x1);
+        } else {
+            a = x1;
+            x1 = x2;
+            f1 = f2;
+            x2 = a + golden * (c - a);
+            f2 = evaluate(vm, f, x2);
+        }
+    }
+    return Operand(f1 < f2 ? x1 : x2);
+}
+
+// Array argument i of a builtin
+static Array *arrayArgument(const Operand *args, int i)
+{
+    if(args[i].type != Operand::ArrayType)
+        throw "Invalid argument type in builtin function";
+    return args[i].array;
+}
+
+// array(n[, value]) creates an array of n elements equal to value, real
+// zeros by default. The elements have the type of value.
+static Operand arrayCreate(VM &vm, const Operand *args, int nargs)
+{
+    if(nargs != 1 && nargs != 2)
+        throw "Wrong number of arguments in builtin function";
+    if(args[0].type != Operand::IntegerType)
+        throw "Invalid argument type in builtin function";
+    Operand value = nargs == 2 ? args[1] : Operand(0.0);
+    number(value);
+
+    int n = args[0].integer;
+    auto array = vm.createArray(value.type, n);
+    if(value.type == Operand::RealType)
+        std::fill(array->reals(), array->reals() + n, value.real);
+    else
+        std::fill(array->integers(), array->integers() + n, value.integer);
+    return Operand(array);
+}
+
+static Operand arrayLength(VM &, const Operand *args, int nargs)
+{
+    checkCount(nargs, 1);
+    return Operand(arrayArgument(args, 0)->getLength());
+}
+
+// Sum of the elements, an integer for integer arrays
+static Operand arraySum(VM &, const Operand *args, int nargs)
+{
+    checkCount(nargs, 1);
+    auto a = arrayArgument(args, 0);
+    int n = a->getLength();
+    if(a->getType() == Operand::IntegerType) {
+        int sum = 0;
+        for(int i = 0; i < n; ++i)
+            sum += a->integers()[i];
+        return Operand(sum);
+    }
+    double sum = 0;
+    for(int i = 0; i < n; ++i)
+        sum += a->reals()[i];
+    return Operand(sum);
+}
+
+// Dot product of two arrays of the same length
+static Operand arrayDot(VM &, const Operand *args, int nargs)
+{
+    checkCount(nargs, 2);
+    auto a = arrayArgument(args, 0);
+    auto b = arrayArgument(args, 1);
+    int n = a->getLength();
+    if(b->getLength() != n)
+        throw "Different array lengths in builtin function";
+    if(a->getType() == Operand::IntegerType && b->getType() == Operand::IntegerType) {
+        int sum = 0;
+        for(int i = 0; i < n; ++i)
+            sum += a->integers()[i] * b->integers()[i];
+        return Operand(sum);
+    }
+    double sum = 0;
+    for(int i = 0; i < n; ++i)
+        sum += a->realAt(i) * b->realAt(i);
+    return Operand(sum);
+}
+
+// map(f, a) creates the array of f(x) for the elements x of a. The new
+// array holds integers as long as f returns integers only.
+static Operand arrayMap(VM &vm, const Operand *args, int nargs)
+{
+    checkCount(nargs, 2);
+    auto a = arrayArgument(args, 1);
+    auto f = vm.prepareCallback(args[0], 1);
+
+    int n = a->getLength();
+    auto result = vm.createArray(Operand::IntegerType, n);
+    for(int i = 0; i < n; ++i) {
+        Operand x = a->get(Operand(i + 1));
+        auto value = vm.callback(f, &x, 1);
+        if(value.type == Operand::RealType && result->getType() == Operand::IntegerType) {
+            auto reals = vm.createArray(Operand::RealType, n);
+            for(int k = 0; k < i; ++k)
+                reals->reals()[k] = result->integers()[k];
+            result = reals;
+        }
+        if(value.type != Operand::IntegerType && value.type != Operand::RealType)
+            throw "Invalid result type of function in builtin function";
+        result->set(Operand(i + 1), value);
+    }
+    return Operand(result);
+}
+
+// gradient(f, x1, ..., xn) evaluates f once at dual numbers and returns
+// the array of the partial derivatives of f at (x1, ..., xn)
+static Operand gradient(VM &vm, const Operand *args, int nargs)
+{
+    if(nargs < 2)
+        throw "Wrong number of arguments in builtin function";
+    int n = nargs - 1;
+    std::vector<Operand> point(n);
+    for(int i = 0; i < n; ++i) {
+        auto x = vm.createDual(number(args[i + 1]), n);
+        x->derivatives()[i] = 1;
+        point[i] = Operand(x);
+    }
+    auto f = vm.prepareCallback(args[0], n);
+
+    auto value = vm.callback(f, point.data(), n);
+    auto result = vm.createArray(Operand::RealType, n);
+    if(dual(value)) {
+        if(value.dual->size() != n)
+            throw "Different derivative counts of dual numbers";
+        std::copy(value.dual->derivatives(), value.dual->derivatives() + n, result->reals());
+    } else if(value.type != Operand::IntegerType && value.type != Operand::RealType) {
+        throw "Invalid result type of function in builtin function";
+    }
+    return Operand(result);
+}
+
+struct Builtin {
+    const char *name;
+    NativeFunction function;
+};
+
+static const Builtin builtins[] = {
+    { "abs", mathAbs },
+    { "acos", mathAcos },
+    { "array", arrayCreate },
+    { "asin", mathAsin },
+    { "atan", mathAtan },
+    { "ceil", mathCeil },
+    { "cos", mathCos },
+    { "cosh", mathCosh },
+    { "dot", arrayDot },
+    { "exp", mathExp },
+    { "floor", mathFloor },
+    { "fmod", mathFmod },
+    { "gradient", gradient },
+    { "hypot", mathHypot },
+    { "integrate", integrate },
+    { "len", arrayLength },
+    { "log", mathLog },
+    { "log10", mathLog10 },
+    { "map", arrayMap },
+    { "max", mathMax },
+    { "min", mathMin },
+    { "minimize", minimize },
+    { "round", mathRound },
+    { "sin", mathSin },
+    { "sinh", mathSinh },
+    { "solve", solve },
+    { "sqrt", mathSqrt },
+    { "sum", arraySum },
+    { "tan", mathTan },
+    { "tanh", mathTanh },
+};
+
+NativeFunction findBuiltin(const std::string &name)
+{
+    for(auto &builtin : builtins)
+        if(name == builtin.name)
+            return builtin.function;
+    return nullptr;
+}
@@ -0,0 +1,28 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include "Operand.h"
+#include <string>
+
+// Native function of the math library, solvers, array functions and
+// gradient named name, nullptr if there is none.
+// Builtins are visible in every function unless a local or upvalue of the
+// same name hides them.
+NativeFunction findBuiltin(const std::string &name);
+
+#endif /* BUILTINS_H */
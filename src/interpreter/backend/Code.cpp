@@ -14,3 +14,271 @@
 // along with this program.  If nOperand::, see <http://www.gnu.org/licenses/>.
 
 #include "Code.h"
+#include <climits>
+
+bool Code::isJump() const
+{
+    switch(op) {
+    case Code::Jmp:
+    case Code::Jnz:
+    case Code::Jlt:
+    case Code::Jle:
+    case Code::Jgt:
+    case Code::Jge:
+    case Code::Jeq:
+    case Code::Jne:
+    case Code::ForPrep:
+    case Code::ForLoop:
+    case Code::ForPrepInt:
+    case Code::ForLoopInt:
+    case Code::Jnlt:
+    case Code::Jnle:
+    case Code::Jngt:
+    case Code::Jnge:
+    case Code::Jz:
+    case Code::JltI:
+    case Code::JleI:
+    case Code::JgtI:
+    case Code::JgeI:
+    case Code::JltR:
+    case Code::JleR:
+    case Code::JgtR:
+    case Code::JgeR:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool Code::fallsThrough() const
+{
+    return op != Code::Jmp && op != Code::ForPrep && op != Code::ForPrepInt && op != Code::Return;
+}
+
+// Append register i when it is not a constant
+static void addRegister(std::vector<int> &regs, int i)
+{
+    if(i >= 0)
+        regs.push_back(i);
+}
+
+// Append registers from start to start+n-1, or up to top-1 when n is -1
+static void addRange(std::vector<int> &regs, int start, int n, int top)
+{
+    int end = n == -1 ? top : start + n;
+    for(int i = start; i < end; ++i)
+        regs.push_back(i);
+}
+
+void Code::getUses(std::vector<int> &regs, int top) const
+{
+    switch(op) {
+    case Code::Add:
+    case Code::Sub:
+    case Code::Mul:
+    case Code::Div:
+    case Code::Pow:
+    case Code::Mod:
+    case Code::Jlt:
+    case Code::Jle:
+    case Code::Jgt:
+    case Code::Jge:
+    case Code::Jeq:
+    case Code::Jne:
+    case Code::Lt:
+    case Code::Le:
+    case Code::Gt:
+    case Code::Ge:
+    case Code::Eq:
+    case Code::Ne:
+    case Code::Jnlt:
+    case Code::Jnle:
+    case Code::Jngt:
+    case Code::Jnge:
+    case Code::Move2:
+    case Code::AddI:
+    case Code::SubI:
+    case Code::MulI:
+    case Code::AddR:
+    case Code::SubR:
+    case Code::MulR:
+    case Code::DivR:
+    case Code::JltI:
+    case Code::JleI:
+    case Code::JgtI:
+    case Code::JgeI:
+    case Code::JltR:
+    case Code::JleR:
+    case Code::JgtR:
+    case Code::JgeR:
+    case Code::GetIndex:
+        addRegister(regs, arg1);
+        addRegister(regs, arg2);
+        break;
+    case Code::SetIndex:
+        addRegister(regs, arg1);
+        addRegister(regs, arg2);
+        addRegister(regs, result);
+        break;
+    case Code::NewArray:
+        addRange(regs, arg1, arg2, top);
+        break;
+    case Code::Minus:
+    case Code::Jnz:
+    case Code::Jz:
+    case Code::Move:
+    case Code::SetUpval:
+        addRegister(regs, arg1);
+        break;
+    case Code::Call:
+        addRange(regs, arg1, arg2 == -1 ? -1 : arg2 + 1, top);
+        break;
+    case Code::Return:
+        addRange(regs, arg1, arg2, top);
+        break;
+    case Code::ForPrep:
+        regs.push_back(arg1);
+        regs.push_back(arg1 + 2);
+        break;
+    case Code::ForPrepInt:
+        addRange(regs, arg1, 3, top);
+        break;
+    case Code::ForLoop:
+    case Code::ForLoopInt:
+        addRange(regs, arg1, 4, top);
+        break;
+    default:
+        break;
+    }
+}
+
+void Code::getDefs(std::vector<int> &regs, int top) const
+{
+    switch(op) {
+    case Code::Add:
+    case Code::Sub:
+    case Code::Mul:
+    case Code::Div:
+    case Code::Pow:
+    case Code::Mod:
+    case Code::Minus:
+    case Code::Move:
+    case Code::Closure:
+    case Code::ClosureLocal:
+    case Code::GetUpval:
+    case Code::Bool:
+    case Code::Lt:
+    case Code::Le:
+    case Code::Gt:
+    case Code::Ge:
+    case Code::Eq:
+    case Code::Ne:
+    case Code::AddI:
+    case Code::SubI:
+    case Code::MulI:
+    case Code::AddR:
+    case Code::SubR:
+    case Code::MulR:
+    case Code::DivR:
+    case Code::NewArray:
+    case Code::GetIndex:
+        regs.push_back(result);
+        break;
+    case Code::Call:
+        addRange(regs, arg1, -1, top);
+        break;
+    case Code::Nil:
+        addRange(regs, arg1, arg2, top);
+        break;
+    case Code::Move2:
+        regs.push_back(result);
+        regs.push_back(result + 1);
+        break;
+    case Code::ForPrep:
+    case Code::ForLoop:
+        regs.push_back(arg1 + 3);
+        break;
+    case Code::ForPrepInt:
+    case Code::ForLoopInt:
+        regs.push_back(arg1 + 1);
+        regs.push_back(arg1 + 3);
+        break;
+    default:
+        break;
+    }
+}
+
+int Code::tripCount(int start, int end, int step)
+{
+    long long n;
+    if(step > 0)
+        n = end < start ? 1 : ((long long)end - start) / step + 1;
+    else
+        n = end > start ? 1 : ((long long)start - end) / -(long long)step + 1;
+    return n > INT_MAX ? INT_MAX : n;
+}
+
+Code::OpCode Code::comparison(OpCode op)
+{
+    switch(op) {
+    case Code::Jlt: return Code::Lt;
+    case Code::Jle: return Code::Le;
+    case Code::Jgt: return Code::Gt;
+    case Code::Jge: return Code::Ge;
+    case Code::Jeq: return Code::Eq;
+    case Code::Jne: return Code::Ne;
+    default: return Code::Nop;
+    }
+}
+
+Code::OpCode Code::fused(OpCode first, OpCode second)
+{
+    if(first == Code::Move && second == Code::Move)
+        return Code::Move2;
+    if(first == Code::Move) {
+        switch(second) {
+        case Code::Add:
+        case Code::Sub:
+        case Code::Mul:
+        case Code::Div:
+        case Code::Pow:
+        case Code::AddI:
+        case Code::SubI:
+        case Code::MulI:
+        case Code::AddR:
+        case Code::SubR:
+        case Code::MulR:
+        case Code::DivR:
+        case Code::Lt:
+        case Code::Le:
+        case Code::Gt:
+        case Code::Ge:
+        case Code::Eq:
+        case Code::Ne:
+            return second;
+        default:
+            return Code::Nop;
+        }
+    }
+    if(second != Code::Jmp)
+        return Code::Nop;
+
+    switch(first) {
+    case Code::Jnz: return Code::Jz;
+    case Code::Jlt: return Code::Jnlt;
+    case Code::Jle: return Code::Jnle;
+    case Code::Jgt: return Code::Jngt;
+    case Code::Jge: return Code::Jnge;
+    case Code::Jeq: return Code::Jne;
+    case Code::Jne: return Code::Jeq;
+    case Code::JltI: return Code::JgeI;
+    case Code::JleI: return Code::JgtI;
+    case Code::JgtI: return Code::JleI;
+    case Code::JgeI: return Code::JltI;
+    case Code::JltR: return Code::JgeR;
+    case Code::JleR: return Code::JgtR;
+    case Code::JgtR: return Code::JleR;
+    case Code::JgeR: return Code::JltR;
+    default: return Code::Nop;
+    }
+}
@@ -17,6 +17,7 @@
 #define CODE_H
 
 #include <string>
+#include <vector>
 using std::string;
 
 // instructions description
@@ -55,6 +56,45 @@ static const string opdesc[] = {
     "FORLOOP",
 
     "BOOL",
+
+    "CLOSURELOCAL",
+
+    "FORPREPINT",
+    "FORLOOPINT",
+
+    "LT",
+    "LE",
+    "GT",
+    "GE",
+    "EQ",
+    "NE",
+
+    "JNLT",
+    "JNLE",
+    "JNGT",
+    "JNGE",
+    "JZ",
+    "MOVE2",
+
+    "ADDI",
+    "SUBI",
+    "MULI",
+    "ADDR",
+    "SUBR",
+    "MULR",
+    "DIVR",
+    "JLTI",
+    "JLEI",
+    "JGTI",
+    "JGEI",
+    "JLTR",
+    "JLER",
+    "JGTR",
+    "JGER",
+
+    "NEWARRAY",
+    "GETINDEX",
+    "SETINDEX",
 };
 
 struct Code {
@@ -94,6 +134,49 @@ struct Code {
         ForLoop,    /* A - C -- */
 
         Bool,       /* A - C -- R(C) = A */
+
+        ClosureLocal, /* A B C -- create non-escaping closure with the A-th function
+                         at byte offset B of the frame storage */
+
+        ForPrepInt, /* A B C -- R(A+3) = R(A)-R(A+2), R(A+1) = trip count unless B, PC = C */
+        ForLoopInt, /* A - C -- if R(A+1) > 0: R(A+1) -= 1, R(A+3) += R(A+2), PC = C */
+
+        Lt,         /* A B C -- R(C) = RK(A) < RK(B) */
+        Le,         /* A B C -- R(C) = RK(A) <= RK(B) */
+        Gt,         /* A B C -- R(C) = RK(A) > RK(B) */
+        Ge,         /* A B C -- R(C) = RK(A) >= RK(B) */
+        Eq,         /* A B C -- R(C) = RK(A) == RK(B) */
+        Ne,         /* A B C -- R(C) = RK(A) != RK(B) */
+
+        // Superinstructions, only created by fuseInstructions
+        Jnlt,       /* A B C -- if(!(RK(A) < RK(B))) PC = C */
+        Jnle,       /* A B C -- if(!(RK(A) <= RK(B))) PC = C */
+        Jngt,       /* A B C -- if(!(RK(A) > RK(B))) PC = C */
+        Jnge,       /* A B C -- if(!(RK(A) >= RK(B))) PC = C */
+        Jz,         /* A - C -- if(RK(A) == false) PC = C */
+        Move2,      /* A B C -- R(C) = RK(A), R(C+1) = RK(B) */
+
+        // Typed codes, only created by inferTypes. Operand types are
+        // proven at compile time, I for integers and R for reals.
+        AddI,       /* A B C -- R(C) = RK(A)+RK(B) */
+        SubI,       /* A B C -- R(C) = RK(A)-RK(B) */
+        MulI,       /* A B C -- R(C) = RK(A)*RK(B) */
+        AddR,       /* A B C -- R(C) = RK(A)+RK(B) */
+        SubR,       /* A B C -- R(C) = RK(A)-RK(B) */
+        MulR,       /* A B C -- R(C) = RK(A)*RK(B) */
+        DivR,       /* A B C -- R(C) = RK(A)/RK(B) */
+        JltI,       /* A B C -- if(RK(A) < RK(B)) PC = C */
+        JleI,       /* A B C -- if(RK(A) <= RK(B)) PC = C */
+        JgtI,       /* A B C -- if(RK(A) > RK(B)) PC = C */
+        JgeI,       /* A B C -- if(RK(A) >= RK(B)) PC = C */
+        JltR,       /* A B C -- if(RK(A) < RK(B)) PC = C */
+        JleR,       /* A B C -- if(RK(A) <= RK(B)) PC = C */
+        JgtR,       /* A B C -- if(RK(A) > RK(B)) PC = C */
+        JgeR,       /* A B C -- if(RK(A) >= RK(B)) PC = C */
+
+        NewArray,   /* A B C -- R(C) = [R(A), ..., R(A+B-1)] */
+        GetIndex,   /* A B C -- R(C) = R(A)[RK(B)] */
+        SetIndex,   /* A B C -- R(A)[RK(B)] = RK(C) */
     };
 
     // three-address code
@@ -108,6 +191,28 @@ struct Code {
     Code(OpCode op, int arg1, int arg2, int result): op(op), arg1(arg1),
         arg2(arg2), result(result) {
     }
+
+    // Whether the instruction may transfer control to code index result
+    bool isJump() const;
+    // Whether the instruction may continue with the next instruction
+    bool fallsThrough() const;
+    // Registers read by the instruction. Operand counts of -1 (variable
+    // arguments or results) extend the range up to register top-1.
+    void getUses(std::vector<int> &regs, int top) const;
+    // Registers written by the instruction. A call clobbers every register
+    // from its closure register up to register top-1.
+    void getDefs(std::vector<int> &regs, int top) const;
+
+    // Iterations of a for loop over integers from start to end by step.
+    // Like ForLoop, a range running against the step still runs once.
+    static int tripCount(int start, int end, int step);
+    // Value-producing comparison testing the same as jump op, Nop if none
+    static OpCode comparison(OpCode op);
+    // Superinstruction executing first followed by second, Nop if none.
+    // Conditional jumps fuse with a Jmp they skip into the negated jump,
+    // a Move into an operand of arithmetic or a comparison into the
+    // arithmetic or comparison reading the moved value itself.
+    static OpCode fused(OpCode first, OpCode second);
 };
 
 #endif /* CODE_H */
@@ -0,0 +1,110 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Dual.h"
+#include <new>
+#include <cmath>
+#include <algorithm>
+
+Dual *Dual::create(double value, int n, Allocator &allocator)
+{
+    auto dual = new(allocator.allocate(allocationSize(n))) Dual(value, n, &allocator);
+    std::fill(dual->derivatives(), dual->derivatives() + n, 0.0);
+    return dual;
+}
+
+ostream & operator <<(ostream & os, const Dual & a)
+{
+    os << a.value << " [";
+    for(int i = 0; i < a.n; ++i)
+        os << (i ? ", " : "") << a.derivatives()[i];
+    os << "]";
+    return os;
+}
+
+double dualValue(const Operand &a)
+{
+    switch(a.type) {
+    case Operand::IntegerType:
+        return a.integer;
+    case Operand::RealType:
+        return a.real;
+    case Operand::DualType:
+        return a.dual->getValue();
+    default:
+        throw "Invalid operands type in dual number arithmetic";
+    }
+}
+
+// Numbers have no derivatives, so their slopes are never used, e.g. the
+// logarithm of a negative base
+Operand dualApply(const Operand &a, const Operand &b, double value, double sa, double sb)
+{
+    const Dual *da = a.type == Operand::DualType ? a.dual : nullptr;
+    const Dual *db = b.type == Operand::DualType ? b.dual : nullptr;
+    if(da && db && da->size() != db->size())
+        throw "Different derivative counts of dual numbers";
+
+    auto any = da ? da : db;
+    if(!any)
+        return Operand(value);
+    auto result = Dual::create(value, any->size(), any->getAllocator());
+    auto d = result->derivatives();
+    for(int i = 0; i < any->size(); ++i)
+        d[i] = (da ? sa * da->derivatives()[i] : 0) + (db ? sb * db->derivatives()[i] : 0);
+    return Operand(result);
+}
+
+Operand dualAdd(const Operand &left, const Operand &right)
+{
+    return dualApply(left, right, dualValue(left) + dualValue(right), 1, 1);
+}
+
+Operand dualSub(const Operand &left, const Operand &right)
+{
+    return dualApply(left, right, dualValue(left) - dualValue(right), 1, -1);
+}
+
+Operand dualMul(const Operand &left, const Operand &right)
+{
+    double a = dualValue(left), b = dualValue(right);
+    return dualApply(left, right, a * b, b, a);
+}
+
+Operand dualDiv(const Operand &left, const Operand &right)
+{
+    double a = dualValue(left), b = dualValue(right);
+    return dualApply(left, right, a / b, 1 / b, -a / (b * b));
+}
+
+Operand dualPow(const Operand &left, const Operand &right)
+{
+    double a = dualValue(left), b = dualValue(right);
+    double value = std::pow(a, b);
+    double sa = b == 0 ? 0 : b * std::pow(a, b - 1);
+    double sb = right.type == Operand::DualType ? value * std::log(a) : 0;
+    return dualApply(left, right, value, sa, sb);
+}
+
+Operand dualMinus(const Operand &a)
+{
+    return dualApply(a, Operand(), -dualValue(a), -1, 0);
+}
+
+Operand dualApply(const Operand &a, double value, double slope)
+{
+    return dualApply(a, Operand(), value, slope, 0);
+}
@@ -0,0 +1,91 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#ifndef DUAL_H
+#define DUAL_H
+
+#include "Operand.h"
+#include "Allocator.h"
+
+// Dual number of forward mode automatic differentiation: a value and its
+// derivatives with respect to n inputs, laid out after the object. Results
+// of arithmetic on dual numbers are allocated from the allocator of their
+// operands and freed in bulk with it.
+class Dual {
+public:
+    // Allocate dual number of value with n derivatives, all zero
+    static Dual *create(double value, int n, Allocator &allocator);
+
+    Dual(const Dual &) = delete;
+    Dual & operator = (const Dual &) = delete;
+
+    double getValue() const {
+        return value;
+    }
+
+    // Count of derivatives
+    int size() const {
+        return n;
+    }
+
+    double *derivatives() {
+        return reinterpret_cast<double *>(this + 1);
+    }
+
+    const double *derivatives() const {
+        return reinterpret_cast<const double *>(this + 1);
+    }
+
+    Allocator &getAllocator() const {
+        return *allocator;
+    }
+
+    // Size in bytes of a dual number with n derivatives
+    static std::size_t allocationSize(int n) {
+        return sizeof(Dual) + n * sizeof(double);
+    }
+
+    friend ostream & operator <<(ostream & os, const Dual & a);
+
+private:
+    Dual(double value, int n, Allocator *allocator)
+        :allocator(allocator), value(value), n(n) {
+    }
+
+    Allocator *allocator;
+    double value;
+    int n;
+};
+
+// Value of number or dual operand a
+double dualValue(const Operand &a);
+
+// Arithmetic of operands of which at least one is dual, the other may be
+// a number. The derivatives follow the chain rule.
+Operand dualAdd(const Operand &left, const Operand &right);
+Operand dualSub(const Operand &left, const Operand &right);
+Operand dualMul(const Operand &left, const Operand &right);
+Operand dualDiv(const Operand &left, const Operand &right);
+Operand dualPow(const Operand &left, const Operand &right);
+Operand dualMinus(const Operand &a);
+
+// Result of function f at a, where value = f(a) and slope = f'(a)
+Operand dualApply(const Operand &a, double value, double slope);
+// Result of function f at (a, b), where value = f(a, b) and the slopes
+// are the partial derivatives of f. One of a and b may be a number.
+Operand dualApply(const Operand &a, const Operand &b, double value, double sa, double sb);
+
+#endif /* DUAL_H */
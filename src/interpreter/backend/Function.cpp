@@ -15,15 +15,29 @@
 
 #include "Function.h"
 #include <iostream>
+#include <new>
+#include <algorithm>
+
+Function::~Function()
+{
+    // Children read their packed storage until they are gone
+    if(arena)
+        destroyPacked();
+    for(std::size_t i = 0; i < childCount(); ++i)
+        delete getChild(i);
+    delete [] arena;
+}
 
 Code *Function::getBaseCode()
 {
+    if(frozen)
+        return packed.ncodes ? packed.codes : nullptr;
     return codes.empty()? nullptr : &codes[0];
 }
 
 std::size_t Function::codeSize() const
 {
-    return codes.size();
+    return frozen ? packed.ncodes : codes.size();
 }
 
 void Function::adjustSlotCount(const Code &code) 
@@ -38,13 +52,29 @@ void Function::adjustSlotCount(const Code &code)
     case Code::Jle:
     case Code::Jeq:
     case Code::Jne:
+    case Code::Jnlt:
+    case Code::Jnle:
+    case Code::Jngt:
+    case Code::Jnge:
+    case Code::Jz:
+    case Code::JltI:
+    case Code::JleI:
+    case Code::JgtI:
+    case Code::JgeI:
+    case Code::JltR:
+    case Code::JleR:
+    case Code::JgtR:
+    case Code::JgeR:
     case Code::Return:
     case Code::SetUpval:
+    case Code::SetIndex:
         break;
     case Code::Call:
-        n = code.arg2 > code.result ? code.arg2 : code.result;
-        n = n > 0 ? n : 0;
+        // R(A) ... R(A+B) and R(A) ... R(A+C-1)
+        n = code.arg2 + 1 > code.result ? code.arg2 + 1 : code.result;
+        n = n > 1 ? n : 1;
         nslots = code.arg1 + n > nslots ? code.arg1 + n : nslots;
+        break;
     case Code::Move:
     case Code::Add:
     case Code::Sub:
@@ -55,18 +85,54 @@ void Function::adjustSlotCount(const Code &code)
     case Code::Minus:
     case Code::GetUpval:
     case Code::Closure:
+    case Code::ClosureLocal:
+    case Code::Bool:
+    case Code::Lt:
+    case Code::Le:
+    case Code::Gt:
+    case Code::Ge:
+    case Code::Eq:
+    case Code::Ne:
+    case Code::AddI:
+    case Code::SubI:
+    case Code::MulI:
+    case Code::AddR:
+    case Code::SubR:
+    case Code::MulR:
+    case Code::DivR:
+    case Code::GetIndex:
         nslots = code.result + 1 > nslots ? code.result + 1 : nslots;
         break;
+    case Code::NewArray:
+        n = code.arg1 + code.arg2 > code.result + 1 ? code.arg1 + code.arg2 : code.result + 1;
+        nslots = n > nslots ? n : nslots;
+        break;
+    case Code::Move2:
+        nslots = code.result + 2 > nslots ? code.result + 2 : nslots;
+        break;
     case Code::Nil:
-        nslots = code.arg1 + code.arg2 - 1 > nslots ? code.arg1 + code.arg2 - 1 : nslots;
+        nslots = code.arg1 + code.arg2 > nslots ? code.arg1 + code.arg2 : nslots;
+        break;
+    case Code::ForPrep:
+    case Code::ForLoop:
+    case Code::ForPrepInt:
+    case Code::ForLoopInt:
+        nslots = code.arg1 + 4 > nslots ? code.arg1 + 4 : nslots;
         break;
     default: break;
     }
 }
 
+void Function::recountSlots()
+{
+    nslots = scopes[0].locals.size();
+    for(auto &code : codes)
+        adjustSlotCount(code);
+}
+
 Code *Function::getCode(std::size_t index)
 {
-    return &codes[index];
+    return frozen ? &packed.codes[index] : &codes[index];
 }
 
 std::size_t Function::addCode(const Code &code, int line)
@@ -88,7 +154,7 @@ std::size_t Function::addConstant(const Operand & a)
 
 const Operand & Function::getConstant(int i) const
 {
-    return constants[i];
+    return frozen ? packed.constants[i] : constants[i];
 
 }
 
@@ -124,54 +190,149 @@ std::size_t Function::createChild(string name)
 {
     auto child = new Function(name);
     child->parent = this;
+    child->lazy = lazy;
     children.push_back(child);
     return children.size() - 1;
 }
 
 Function *Function::getChild(std::size_t i)
 {
-    return children[i];
+    return frozen ? packed.children[i] : children[i];
+}
+
+// Place n objects of type T at offset, aligned, and move offset past them.
+// Returns their address in arena, null when only sizes are computed.
+template<typename T>
+static T *reserve(char *arena, std::size_t &offset, std::size_t n)
+{
+    offset = (offset + alignof(T) - 1) / alignof(T) * alignof(T);
+    T *p = arena ? reinterpret_cast<T *>(arena + offset) : nullptr;
+    offset += n * sizeof(T);
+    return p;
+}
+
+void Function::freeze()
+{
+    if(frozen || deferred)
+        return;
+
+    std::size_t size = 0;
+    pack(nullptr, size);
+    arena = new char[size];
+    std::size_t offset = 0;
+    pack(arena, offset);
+}
+
+// Each function is laid out as its constants, upvalues, children, codes
+// and lines, followed by its descendants in depth-first order
+void Function::pack(char *arena, std::size_t &offset)
+{
+    if(frozen || deferred)
+        return;
+
+    auto packedConstants = reserve<Operand>(arena, offset, constants.size());
+    auto packedUpvalues = reserve<UpvalueInfo>(arena, offset, upvalueInfos.size());
+    auto packedChildren = reserve<Function *>(arena, offset, children.size());
+    auto packedCodes = reserve<Code>(arena, offset, codes.size());
+    auto packedLines = reserve<int>(arena, offset, lines.size());
+
+    if(arena) {
+        for(std::size_t i = 0; i < constants.size(); ++i)
+            new(&packedConstants[i]) Operand(constants[i]);
+        for(std::size_t i = 0; i < upvalueInfos.size(); ++i) {
+            auto &info = upvalueInfos[i];
+            new(&packedUpvalues[i]) UpvalueInfo(string(), info.isParentLocal, info.registerIndex);
+        }
+        std::copy(children.begin(), children.end(), packedChildren);
+        std::copy(codes.begin(), codes.end(), packedCodes);
+        std::copy(lines.begin(), lines.end(), packedLines);
+
+        packed.codes = packedCodes;
+        packed.lines = packedLines;
+        packed.constants = packedConstants;
+        packed.upvalueInfos = packedUpvalues;
+        packed.children = packedChildren;
+        packed.ncodes = codes.size();
+        packed.nconstants = constants.size();
+        packed.nupvalues = upvalueInfos.size();
+        packed.nchildren = children.size();
+    }
+
+    for(std::size_t i = 0; i < children.size(); ++i)
+        children[i]->pack(arena, offset);
+
+    if(arena) {
+        // Release the storage of the vectors, not only their contents
+        std::vector<Code>().swap(codes);
+        std::vector<int>().swap(lines);
+        std::vector<Operand>().swap(constants);
+        std::vector<Function *>().swap(children);
+        std::vector<SymbolScope>().swap(scopes);
+        std::vector<UpvalueInfo>().swap(upvalueInfos);
+        ntemps = 0;
+        frozen = true;
+    }
+}
+
+void Function::destroyPacked()
+{
+    if(!frozen)
+        return;
+    for(std::size_t i = 0; i < packed.nconstants; ++i)
+        packed.constants[i].~Operand();
+    for(std::size_t i = 0; i < packed.nupvalues; ++i)
+        packed.upvalueInfos[i].~UpvalueInfo();
+    for(std::size_t i = 0; i < packed.nchildren; ++i)
+        packed.children[i]->destroyPacked();
 }
 
 ostream & operator <<(ostream & os, const Function & f)
 {
+    const Code *codes = f.frozen ? f.packed.codes : f.codes.data();
+    Function * const *children = f.frozen ? f.packed.children : f.children.data();
+
     // Function informations and instructions
-    os << "\n" << f.name << " (" << f.codes.size() << " instructions at " << &f << ")" << std::endl;
+    os << "\n" << f.name << " (" << f.codeSize() << " instructions at " << &f << ")" << std::endl;
     os << f.nparams << " params, "
        << f.nslots << " slots, "
-       << f.upvalueInfos.size() << " upvalues, "
-       << f.scopes[0].locals.size() << " locals, "
+       << f.upvalueCount() << " upvalues, "
+       << f.outerLocalCount() << " locals, "
        << f.constantCount() << " constants, "
-       << f.children.size() << " functions"
+       << f.childCount() << " functions"
        << std::endl;
+    if(f.deferred)
+        os << "body compiled on first call" << std::endl;
+    if(f.frozen)
+        os << "frozen, symbols dropped" << std::endl;
 
     // Codes
-    for (auto i = 0; i < f.codes.size(); ++i)
-        os << "\t" << i << "\t[" << f.lines[i] << "]\t" << opdesc[f.codes[i].op] << "\t" << f.codes[i].arg1
-           << "\t" << f.codes[i].arg2 << "\t " << f.codes[i].result << std::endl;
+    for (std::size_t i = 0; i < f.codeSize(); ++i)
+        os << "\t" << i << "\t[" << f.getLine(i) << "]\t" << opdesc[codes[i].op] << "\t" << codes[i].arg1
+           << "\t" << codes[i].arg2 << "\t " << codes[i].result << std::endl;
 
     // Constants
     os << "constants (" << f.constantCount() << ") for " << &f << ":" << std::endl;
-    for (auto i = 1; i < f.constants.size(); ++i)
-        os << "\t" << i << "\t" << f.constants[i] << std::endl;
+    for (int i = 1; i <= f.constantCount(); ++i)
+        os << "\t" << i << "\t" << f.getConstant(i) << std::endl;
 
     // Locals
-    os << "locals (" << f.scopes[0].locals.size() << ") for " << &f << ":" << std::endl;
-    for (auto i = 0; i < f.scopes[0].locals.size(); ++i)
+    os << "locals (" << f.outerLocalCount() << ") for " << &f << ":" << std::endl;
+    for (auto i = 0; i < f.outerLocalCount(); ++i)
         os << "\t" << i << "\t" << f.scopes[0].locals[i].name << std::endl;
 
 
     // Upvalues
-    os << "upvalues (" << f.upvalueInfos.size() << ") for " << &f << ":" << std::endl;
-    for (auto i = 0; i < f.upvalueInfos.size(); ++i) {
-        os << "\t" << i << "\t" << f.upvalueInfos[i].name
-           << "\t" << f.upvalueInfos[i].isParentLocal
-           << "\t" << f.upvalueInfos[i].registerIndex
+    os << "upvalues (" << f.upvalueCount() << ") for " << &f << ":" << std::endl;
+    for (auto i = 0; i < f.upvalueCount(); ++i) {
+        auto info = f.getUpvalueInfo(i);
+        os << "\t" << i << "\t" << info->name
+           << "\t" << info->isParentLocal
+           << "\t" << info->registerIndex
            << std::endl;
     }
 
-    for(auto child: f.children)
-        os << *child;
+    for(std::size_t i = 0; i < f.childCount(); ++i)
+        os << *children[i];
 
     return os;
 }
@@ -289,3 +450,39 @@ void Function::reverseCodes(int start, int end)
         codes[j] = temp;
     }
 }
+
+Closure *Closure::create(Function * prototype, Allocator &allocator)
+{
+    return createAt(allocator.allocate(allocationSize(prototype->upvalueCount())), prototype);
+}
+
+Closure *Closure::createAt(void *memory, Function * prototype)
+{
+    int n = prototype->upvalueCount();
+    auto closure = new(memory) Closure(prototype, n);
+    for(int i = 0; i < n; ++i)
+        closure->setUpvalue(i, nullptr);
+    return closure;
+}
+
+void Closure::destroy(Closure *closure, Allocator &allocator)
+{
+    int n = closure->upvalueCount();
+    closure->~Closure();
+    allocator.deallocate(closure, allocationSize(n));
+}
+
+void Function::replaceCode(std::size_t i, const std::vector<Code> &newCodes, const std::vector<int> &newLines)
+{
+    int shift = (int)newCodes.size() - 1;
+    for(std::size_t j = 0; j < codes.size(); ++j) {
+        if(j != i && codes[j].isJump() && codes[j].result > (int)i)
+            codes[j].result += shift;
+    }
+    codes.erase(codes.begin() + i);
+    lines.erase(lines.begin() + i);
+    codes.insert(codes.begin() + i, newCodes.begin(), newCodes.end());
+    lines.insert(lines.begin() + i, newLines.begin(), newLines.end());
+    for(auto &code : newCodes)
+        adjustSlotCount(code);
+}
@@ -18,6 +18,7 @@
 
 #include "Code.h"
 #include "Operand.h"
+#include "Allocator.h"
 #include <vector>
 #include <iostream>
 #include <string>
@@ -65,7 +66,9 @@ struct SymbolScope {
 // class object. This class contains some static information generated after parsing.
 class Function {
 public:
-    Function(string name):name(name), nparams(0), nresults(0), nslots(0), ntemps(0), parent(nullptr) {
+    Function(string name):name(name), nparams(0), nresults(0), nslots(0), nframeBytes(0),
+        ntemps(0), parent(nullptr), optimized(false), pure(false), lazy(false), deferred(false),
+        deferredLine(0), frozen(false), arena(nullptr) {
         constants.push_back(Operand());
         scopes.push_back(SymbolScope());
     }
@@ -73,21 +76,35 @@ public:
     Function(const Function &) = delete;
     Function & operator = (const Function &) = delete;
 
-    ~Function() {
-        for(auto child: children)
-            delete child;
+    ~Function();
+
+    const string &getName() const {
+        return name;
     }
 
     // Function instructions and size
     Code *getBaseCode();
     void clearCodes() {
         codes.clear();
+        lines.clear();
         ntemps = localSymbolCount();
+        optimized = false;
     }
     std::size_t codeSize()const;
     Code *getCode(std::size_t i);
     std::size_t addCode(const Code &code, int line);
+    // Drop the last code, it must not be the target of any jump
+    void removeLastCode() {
+        codes.pop_back();
+        lines.pop_back();
+    }
     void reverseCodes(int start, int end);
+    int getLine(std::size_t i) const {
+        return frozen ? packed.lines[i] : lines[i];
+    }
+    // Replace the code at index i with newCodes, jump targets behind i
+    // are moved accordingly. Targets inside newCodes must be final.
+    void replaceCode(std::size_t i, const std::vector<Code> &newCodes, const std::vector<int> &newLines);
 
     std::size_t addConstant(const Operand & c);
     const Operand & getConstant(int i) const;
@@ -98,6 +115,8 @@ public:
     std::size_t addParam(const LocalSymbolInfo &paramInfo);
 
     void adjustSlotCount(const Code &code);
+    // Recompute count of registers after codes are rewritten
+    void recountSlots();
     int slotCount() const {
         return nslots;
     }
@@ -106,12 +125,86 @@ public:
         return nparams;
     }
 
+    // Bytes of frame storage for non-escaping closures
+    int frameStorageSize() const {
+        return nframeBytes;
+    }
+
+    // Reserve n bytes of frame storage, return its offset
+    int reserveFrameStorage(int n) {
+        int offset = nframeBytes;
+        nframeBytes += n;
+        return offset;
+    }
+
+    // Whether compile-time passes already run on this function
+    bool isOptimized() const {
+        return optimized;
+    }
+
+    void setOptimized() {
+        optimized = true;
+    }
+
+    // Whether the result only depends on the arguments, so that calls
+    // with the same numeric arguments may be memoized
+    bool isPure() const {
+        return pure;
+    }
+
+    void setPure(bool pure) {
+        this->pure = pure;
+    }
+
+    // Whether bodies of children are compiled when they are first called,
+    // children inherit this mode
+    bool isLazy() const {
+        return lazy;
+    }
+
+    void setLazy(bool lazy) {
+        this->lazy = lazy;
+    }
+
+    // Keep the source of the body starting at line, the codes are a stub
+    // until the body is compiled on the first call
+    void defer(const string &body, int line) {
+        deferredBody = body;
+        deferredLine = line;
+        deferred = true;
+    }
+
+    bool isDeferred() const {
+        return deferred;
+    }
+
+    void setCompiled() {
+        deferred = false;
+    }
+
+    int getDeferredLine() const {
+        return deferredLine;
+    }
+
+    // Move out the deferred body, it is empty after a failed compilation
+    string takeDeferredBody() {
+        string body;
+        body.swap(deferredBody);
+        return body;
+    }
+
     int resultCount() const {
         return nresults;
     }
 
     int constantCount() const {
-        return constants.size() - 1;
+        return (frozen ? packed.nconstants : constants.size()) - 1;
+    }
+
+    // Count of locals in the outermost scope, including parameters.
+    // Their registers are 0 ... outerLocalCount()-1.
+    int outerLocalCount() const {
+        return scopes.empty() ? 0 : scopes[0].locals.size();
     }
 
     int localSymbolCount() const {
@@ -124,11 +217,12 @@ public:
     std::size_t addUpvalueInfo(const UpvalueInfo &upvalueInfo);
 
     int upvalueCount() const {
-        return upvalueInfos.size();
+        return frozen ? packed.nupvalues : upvalueInfos.size();
     }
 
+    // Names of upvalues are dropped when the function is frozen
     const UpvalueInfo *getUpvalueInfo(std::size_t index) const {
-        return &upvalueInfos[index];
+        return frozen ? &packed.upvalueInfos[index] : &upvalueInfos[index];
     }
 
     int findUpvalue(string name) const;
@@ -138,10 +232,24 @@ public:
 
     std::size_t createChild(string name);
     Function * getChild(std::size_t index);
+    std::size_t childCount() const {
+        return frozen ? packed.nchildren : children.size();
+    }
     Function * getParent() {
         return parent;
     }
 
+    // Pack codes, lines, constants, upvalues and children of this function
+    // and its descendants into one arena owned by this function, and drop
+    // the symbols and other state only needed to compile them. Frozen
+    // functions are never changed again. Deferred functions are left out,
+    // they are still compiled on their first call.
+    void freeze();
+
+    bool isFrozen() const {
+        return frozen;
+    }
+
     friend ostream & operator <<(ostream & os, const Function & f);
 
     // Concatenate the lists pointed to by codelist1 and codelist2
@@ -194,6 +302,8 @@ private:
     int nresults;
     // Count of registers used
     int nslots;
+    // Bytes of frame storage used
+    int nframeBytes;
     // Children functions
     std::vector<Function *> children;
     // Local symbol scopes
@@ -204,6 +314,41 @@ private:
     int ntemps;
     // Parent function
     Function *parent;
+    // Compile-time passes done
+    bool optimized;
+    // Result only depends on the arguments
+    bool pure;
+    // Children are compiled on their first call
+    bool lazy;
+    // Body is not compiled yet
+    bool deferred;
+    // Source of the body and its first line, while deferred
+    string deferredBody;
+    int deferredLine;
+
+    // Lay out the packed storage of this function and its descendants from
+    // offset on, only computing the size of the arena when it is null
+    void pack(char *arena, std::size_t &offset);
+    // Destroy the objects in the packed storage of this function and its
+    // descendants
+    void destroyPacked();
+
+    // Storage in the arena, replacing the vectors above once frozen
+    struct Packed {
+        Code *codes;
+        int *lines;
+        Operand *constants;
+        UpvalueInfo *upvalueInfos;
+        Function **children;
+        std::size_t ncodes;
+        std::size_t nconstants;
+        std::size_t nupvalues;
+        std::size_t nchildren;
+    };
+    Packed packed;
+    bool frozen;
+    // Arena of the tree, owned by the function freeze() was called on
+    char *arena;
 };
 
 // Upvalues for closures
@@ -219,14 +364,16 @@ struct Upvalue {
 };
 
 // All runtime function are closures, this class object pointer to a
-// prototype Function object and its upvalues.
+// prototype Function object and its upvalues. Upvalue pointers are laid out
+// right after the closure object, so a closure is a single allocation.
 class Closure {
 public:
-    Closure():prototype(nullptr) {
-    }
-
-    Closure(Function * prototype):prototype(prototype) {
-    }
+    // Allocate closure with room for all upvalues of the prototype
+    static Closure *create(Function * prototype, Allocator &allocator);
+    // Deallocate closure created by create()
+    static void destroy(Closure *closure, Allocator &allocator);
+    // Construct closure in memory of allocationSize() bytes, e.g. frame storage
+    static Closure *createAt(void *memory, Function * prototype);
 
     Closure(const Closure &) = delete;
     Closure & operator = (const Closure &) = delete;
@@ -235,24 +382,38 @@ public:
         return prototype;
     }
 
-    void setPrototype(Function * prototype) {
-        this->prototype = prototype;
+    int upvalueCount() const {
+        return nupvalues;
     }
 
     // Get upvalue by index
-    int getUpvalueIndex(std::size_t i) const {
-        return upvalueIndexes[i];
+    Upvalue *getUpvalue(std::size_t i) const {
+        return upvalueSlots()[i];
     }
 
-    void addUpvalueIndex(int i) {
-        upvalueIndexes.push_back(i);
+    void setUpvalue(std::size_t i, Upvalue *upvalue) {
+        upvalueSlots()[i] = upvalue;
+    }
+
+    // Size in bytes of a closure with n upvalues
+    static std::size_t allocationSize(int n) {
+        return sizeof(Closure) + n * sizeof(Upvalue *);
     }
 
 private:
+    Closure(Function * prototype, int nupvalues)
+        :prototype(prototype), nupvalues(nupvalues) {
+    }
+
+    // Inline upvalue storage, following the closure object
+    Upvalue **upvalueSlots() const {
+        return reinterpret_cast<Upvalue **>(const_cast<Closure *>(this) + 1);
+    }
+
     // Function prototype
     Function * prototype;
-    // Upvalues indexes in runtime stack
-    std::vector<int> upvalueIndexes;
+    // Count of inline upvalues
+    int nupvalues;
 };
 
 #endif /* FUNCTION_H */
@@ -0,0 +1,90 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Memo.h"
+#include <cstring>
+#include <cstdint>
+
+MemoKey::MemoKey(const Operand *args, int nargs): nargs(nargs)
+{
+    for(int i = 0; i < nargs; ++i)
+        this->args[i] = args[i];
+}
+
+static bool isNumber(const Operand &a)
+{
+    return a.type == Operand::IntegerType || a.type == Operand::RealType;
+}
+
+// Reals are compared by their bits, 0.0 and -0.0 are different keys
+static bool same(const Operand &a, const Operand &b)
+{
+    if(a.type != b.type)
+        return false;
+    if(a.type == Operand::IntegerType)
+        return a.integer == b.integer;
+    return std::memcmp(&a.real, &b.real, sizeof(double)) == 0;
+}
+
+bool Memo::isKey(const Operand *args, int nargs)
+{
+    if(nargs < 0 || nargs > MEMO_MAX_ARGS)
+        return false;
+    for(int i = 0; i < nargs; ++i)
+        if(!isNumber(args[i]))
+            return false;
+    return true;
+}
+
+std::size_t Memo::slot(const Operand *args, int nargs)
+{
+    std::uint64_t h = nargs;
+    for(int i = 0; i < nargs; ++i) {
+        std::uint64_t bits;
+        if(args[i].type == Operand::IntegerType)
+            bits = (std::uint32_t)args[i].integer;
+        else
+            std::memcpy(&bits, &args[i].real, sizeof(bits));
+        h = (h ^ bits ^ args[i].type) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return h & (MEMO_SIZE - 1);
+}
+
+const Operand *Memo::find(const Operand *args, int nargs) const
+{
+    if(entries.empty())
+        return nullptr;
+    auto &entry = entries[slot(args, nargs)];
+    if(entry.nargs != nargs)
+        return nullptr;
+    for(int i = 0; i < nargs; ++i)
+        if(!same(entry.args[i], args[i]))
+            return nullptr;
+    return &entry.result;
+}
+
+void Memo::store(const MemoKey &key, const Operand &result)
+{
+    if(!isNumber(result))
+        return;
+    if(entries.empty())
+        entries.resize(MEMO_SIZE);
+    auto &entry = entries[slot(key.args, key.nargs)];
+    for(int i = 0; i < key.nargs; ++i)
+        entry.args[i] = key.args[i];
+    entry.nargs = key.nargs;
+    entry.result = result;
+}
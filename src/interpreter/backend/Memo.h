@@ -0,0 +1,64 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef MEMO_H
+#define MEMO_H
+
+#include "Operand.h"
+#include <vector>
+
+// Entries of the memo table of each pure function, a power of two
+#define MEMO_SIZE 256
+// Calls with more arguments are not memoized
+#define MEMO_MAX_ARGS 4
+
+// Arguments of a memoized call, kept until it returns its result
+struct MemoKey {
+    Operand args[MEMO_MAX_ARGS];
+    int nargs;
+
+    MemoKey(const Operand *args, int nargs);
+};
+
+// Results of calls of a pure function keyed by their numeric arguments.
+// The table is direct mapped, so it never grows: a result is evicted by
+// the next one whose arguments fall into the same slot.
+class Memo {
+public:
+    // Whether the nargs arguments at args can be a key
+    static bool isKey(const Operand *args, int nargs);
+
+    // Result stored for args, null if there is none
+    const Operand *find(const Operand *args, int nargs) const;
+    // Store result of args, only numbers are stored
+    void store(const MemoKey &key, const Operand &result);
+
+private:
+    struct Entry {
+        Operand args[MEMO_MAX_ARGS];
+        // Count of arguments, -1 for empty entries
+        int nargs;
+        Operand result;
+
+        Entry(): nargs(-1) {}
+    };
+
+    static std::size_t slot(const Operand *args, int nargs);
+
+    // Allocated on first store
+    std::vector<Entry> entries;
+};
+
+#endif /* MEMO_H */
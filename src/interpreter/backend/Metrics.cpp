@@ -0,0 +1,95 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Metrics.h"
+
+static const std::uint64_t bounds[LATENCY_BUCKETS] = {
+    1000, 2500, 5000,
+    10000, 25000, 50000,
+    100000, 250000, 500000,
+    1000000, 2500000, 5000000,
+    10000000, 25000000, 50000000,
+    100000000, 250000000, 500000000,
+    1000000000, 2500000000ULL, 5000000000ULL,
+    10000000000ULL
+};
+
+void LatencyHistogram::observe(std::uint64_t ns)
+{
+    int i = 0;
+    while(i < LATENCY_BUCKETS && ns > bounds[i])
+        ++i;
+    ++buckets[i];
+    ++total;
+    nanoseconds += ns;
+}
+
+void LatencyHistogram::reset()
+{
+    for(auto &b : buckets)
+        b = 0;
+    total = 0;
+    nanoseconds = 0;
+}
+
+std::uint64_t LatencyHistogram::bound(int i)
+{
+    return bounds[i];
+}
+
+static void metric(ostream &os, const char *prefix, const char *name, const char *type,
+                   const char *help)
+{
+    os << "# HELP " << prefix << "_" << name << " " << help << "\n";
+    os << "# TYPE " << prefix << "_" << name << " " << type << "\n";
+    os << prefix << "_" << name << " ";
+}
+
+void writePrometheus(ostream &os, const RuntimeStats &stats, const char *prefix)
+{
+    metric(os, prefix, "instructions_total", "counter", "Codes executed.");
+    os << stats.instructions << "\n";
+    metric(os, prefix, "calls_total", "counter", "Calls of closures and native functions.");
+    os << stats.calls << "\n";
+    metric(os, prefix, "call_depth_max", "gauge", "Maximum count of frames.");
+    os << stats.maxCallDepth << "\n";
+    metric(os, prefix, "closures_created_total", "counter", "Closures created.");
+    os << stats.closuresCreated << "\n";
+    metric(os, prefix, "closures_live", "gauge", "Closures not freed yet.");
+    os << stats.closuresLive << "\n";
+    metric(os, prefix, "upvalues_created_total", "counter", "Upvalues created.");
+    os << stats.upvaluesCreated << "\n";
+    metric(os, prefix, "upvalues_live", "gauge", "Upvalues held on the heap.");
+    os << stats.upvaluesLive << "\n";
+    metric(os, prefix, "registers_max", "gauge", "Maximum count of registers used.");
+    os << stats.registerHighWater << "\n";
+    metric(os, prefix, "compile_seconds_total", "counter", "Time spent compiling.");
+    os << stats.compileTime / 1e9 << "\n";
+    metric(os, prefix, "run_seconds_total", "counter", "Time spent running.");
+    os << stats.runTime / 1e9 << "\n";
+
+    auto &h = stats.latency;
+    os << "# HELP " << prefix << "_evaluation_seconds Latency of evaluations.\n";
+    os << "# TYPE " << prefix << "_evaluation_seconds histogram\n";
+    std::uint64_t cumulative = 0;
+    for(int i = 0; i < LATENCY_BUCKETS; ++i) {
+        cumulative += h.bucket(i);
+        os << prefix << "_evaluation_seconds_bucket{le=\"" << LatencyHistogram::bound(i) / 1e9
+           << "\"} " << cumulative << "\n";
+    }
+    os << prefix << "_evaluation_seconds_bucket{le=\"+Inf\"} " << h.count() << "\n";
+    os << prefix << "_evaluation_seconds_sum " << h.sum() / 1e9 << "\n";
+    os << prefix << "_evaluation_seconds_count " << h.count() << "\n";
+}
@@ -0,0 +1,97 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+using std::ostream;
+
+// Buckets of latency histograms, without the last unbounded one
+#define LATENCY_BUCKETS 22
+
+// Histogram of latencies in nanoseconds, with bounds from 1us to 10s in
+// steps of 1, 2.5 and 5
+class LatencyHistogram {
+public:
+    LatencyHistogram() {
+        reset();
+    }
+
+    void observe(std::uint64_t ns);
+    void reset();
+
+    // Upper bound in nanoseconds of bucket i
+    static std::uint64_t bound(int i);
+
+    // Observations in bucket i, not cumulative. Bucket LATENCY_BUCKETS
+    // holds the ones above the last bound.
+    std::uint64_t bucket(int i) const {
+        return buckets[i];
+    }
+    std::uint64_t count() const {
+        return total;
+    }
+    // Sum of the observations in nanoseconds
+    std::uint64_t sum() const {
+        return nanoseconds;
+    }
+
+private:
+    std::uint64_t buckets[LATENCY_BUCKETS + 1];
+    std::uint64_t total;
+    std::uint64_t nanoseconds;
+};
+
+// Counters of a VM, always collected. Counters grow from the creation of
+// the VM or the last VM::resetStats(), live counts are taken on request.
+struct RuntimeStats {
+    // Codes executed
+    std::uint64_t instructions;
+    // Calls of closures and native functions
+    std::uint64_t calls;
+    // Maximum count of frames
+    std::size_t maxCallDepth;
+    // Closures created, shared and non-escaping ones included
+    std::uint64_t closuresCreated;
+    // Closures not freed yet: those on the heap, held until the VM is
+    // reset, and those in the storage of running frames
+    std::size_t closuresLive;
+    // Upvalues created, those of non-escaping closures included
+    std::uint64_t upvaluesCreated;
+    // Upvalues on the heap, held until the VM is reset
+    std::size_t upvaluesLive;
+    // Maximum count of registers used
+    std::size_t registerHighWater;
+    // Compile time reported by the embedder, in nanoseconds
+    std::uint64_t compileTime;
+    // Time spent in VM::run() and VM::call(), in nanoseconds
+    std::uint64_t runTime;
+    // Latency of each run() and call()
+    LatencyHistogram latency;
+
+    RuntimeStats(): instructions(0), calls(0), maxCallDepth(0), closuresCreated(0),
+        closuresLive(0), upvaluesCreated(0), upvaluesLive(0), registerHighWater(0),
+        compileTime(0), runTime(0) {
+    }
+};
+
+// Write stats in the Prometheus text exposition format, metric names
+// start with prefix
+void writePrometheus(ostream &os, const RuntimeStats &stats, const char *prefix = "formula");
+
+#endif /* METRICS_H */
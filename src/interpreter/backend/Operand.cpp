@@ -15,6 +15,8 @@
 
 #include "Operand.h"
 #include "Function.h"
+#include "Array.h"
+#include "Dual.h"
 #include "math.h"
 
 void Operand::copy(const Operand & a)
@@ -33,6 +35,15 @@ void Operand::copy(const Operand & a)
     case Operand::IntegerType:
         this->integer = a.integer;
         break;
+    case Operand::NativeType:
+        this->native = a.native;
+        break;
+    case Operand::ArrayType:
+        this->array = a.array;
+        break;
+    case Operand::DualType:
+        this->dual = a.dual;
+        break;
     default:
         break;
     }
@@ -65,6 +76,15 @@ ostream & operator <<(ostream & os, const Operand & a)
     case Operand::IntegerType:
         os << a.integer;
         break;
+    case Operand::NativeType:
+        os << "Native:" << (void *)a.native;
+        break;
+    case Operand::ArrayType:
+        os << "Array:" << a.array << " " << *a.array;
+        break;
+    case Operand::DualType:
+        os << "Dual:" << *a.dual;
+        break;
     default:
         os << "Nil";
         break;
@@ -72,10 +92,21 @@ ostream & operator <<(ostream & os, const Operand & a)
     return os;
 }
 
+static bool numeric(const Operand & a)
+{
+    return a.type == Operand::IntegerType || a.type == Operand::RealType
+           || a.type == Operand::DualType;
+}
+
 bool operator ==(const Operand & left, const Operand & right)
 {
-    if (left.type != right.type)
+    if (left.type != right.type) {
+        // Dual numbers compare their values only
+        if ((left.type == Operand::DualType || right.type == Operand::DualType)
+                && numeric(left) && numeric(right))
+            return dualValue(left) == dualValue(right);
         return false;
+    }
 
     switch (left.type) {
     case Operand::NilType:
@@ -86,6 +117,12 @@ bool operator ==(const Operand & left, const Operand & right)
         return left.real == right.real;
     case Operand::IntegerType:
         return left.integer == right.integer;
+    case Operand::NativeType:
+        return left.native == right.native;
+    case Operand::ArrayType:
+        return left.array == right.array;
+    case Operand::DualType:
+        return left.dual->getValue() == right.dual->getValue();
     default:
         throw "Unkown operand type";
     }
@@ -111,6 +148,9 @@ bool operator >(const Operand & left, const Operand & right)
     } else if (left.type == Operand::RealType
                && right.type == Operand::RealType) {
         return left.real > right.real;
+    } else if (left.type == Operand::DualType
+               || right.type == Operand::DualType) {
+        return dualValue(left) > dualValue(right);
     } else {
         throw "invalid operands type in comparison";
     }
@@ -150,6 +190,9 @@ Operand operator +(const Operand & left, const Operand & right)
                && right.type == Operand::RealType) {
         result.type = Operand::RealType;
         result.real = left.real + right.real;
+    } else if (left.type == Operand::DualType
+               || right.type == Operand::DualType) {
+        return dualAdd(left, right);
     } else {
         throw "Invalid operands type in addition";
     }
@@ -175,6 +218,9 @@ Operand operator -(const Operand & left, const Operand & right)
                && right.type == Operand::RealType) {
         result.type = Operand::RealType;
         result.real = left.real - right.real;
+    } else if (left.type == Operand::DualType
+               || right.type == Operand::DualType) {
+        return dualSub(left, right);
     } else {
         throw "Invalid operands type in substraction";
     }
@@ -200,6 +246,9 @@ Operand operator *(const Operand & left, const Operand & right)
                && right.type == Operand::RealType) {
         result.type = Operand::RealType;
         result.real = left.real * right.real;
+    } else if (left.type == Operand::DualType
+               || right.type == Operand::DualType) {
+        return dualMul(left, right);
     } else {
         throw "Invalid operands type in multiplication";
     }
@@ -226,6 +275,9 @@ Operand operator /(const Operand & left, const Operand & right)
                && right.type == Operand::RealType) {
         a = left.real;
         b = right.real;
+    } else if (left.type == Operand::DualType
+               || right.type == Operand::DualType) {
+        return dualDiv(left, right);
     } else {
         throw "Invalid operands type in division";
     }
@@ -255,6 +307,9 @@ Operand pow(const Operand & left, const Operand & right)
                && right.type == Operand::RealType) {
         a = left.real;
         b = right.real;
+    } else if (left.type == Operand::DualType
+               || right.type == Operand::DualType) {
+        return dualPow(left, right);
     } else {
         throw "Invalid operands type in pow";
     }
@@ -272,6 +327,8 @@ Operand operator -(const Operand & a) {
     } else if (a.type == Operand::RealType) {
         result.type = Operand::RealType;
         result.real = -a.real;
+    } else if (a.type == Operand::DualType) {
+        return dualMinus(a);
     } else {
         throw "Invalid operands type in unary minus";
     }
@@ -19,7 +19,14 @@
 #include <iostream>
 using std::ostream;
 
+class Array;
 class Closure;
+class Dual;
+class Operand;
+class VM;
+
+// Function implemented in C++, called with the nargs arguments at args
+typedef Operand (*NativeFunction)(VM &vm, const Operand *args, int nargs);
 
 class Operand {
 public:
@@ -28,12 +35,18 @@ public:
         ClosureType,
         RealType,
         IntegerType,
+        NativeType,
+        ArrayType,
+        DualType,
     };
 
     union {
         Closure *closure;
         double real;
         int integer;
+        NativeFunction native;
+        Array *array;
+        Dual *dual;
     };
 
     OperandType type;
@@ -42,7 +55,7 @@ public:
     }
 
     ~Operand() {
-        // Operand object only holds closure pointer, the deallocation of closure object
+        // Operand object only holds closure, array or dual pointer, the deallocation of the object
         // is implemented in class VM
     }
 
@@ -57,6 +70,18 @@ public:
         type(Operand::IntegerType) {
     }
 
+    explicit Operand(NativeFunction native):native(native),
+        type(Operand::NativeType) {
+    }
+
+    explicit Operand(Array * array):array(array),
+        type(Operand::ArrayType) {
+    }
+
+    explicit Operand(Dual * dual):dual(dual),
+        type(Operand::DualType) {
+    }
+
     Operand(const Operand & a);
 
     void setNil() {
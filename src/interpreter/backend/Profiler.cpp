@@ -0,0 +1,160 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Profiler.h"
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+Profiler::Profiler()
+{
+    reset();
+}
+
+void Profiler::reset()
+{
+    opcodes.assign(OPCODE_COUNT, 0);
+    functions.clear();
+    nodes.clear();
+    nodes.push_back(Node(nullptr, -1));
+    frames.clear();
+}
+
+void Profiler::enter(Function *function)
+{
+    auto &stats = functions[function];
+    if(stats.counts.size() < function->codeSize())
+        stats.counts.resize(function->codeSize(), 0);
+    ++stats.calls;
+    if(stats.active++ == 0)
+        stats.start = Clock::now();
+
+    int parent = frames.empty() ? 0 : frames.back().node;
+    int node;
+    auto it = nodes[parent].children.find(function);
+    if(it == nodes[parent].children.end()) {
+        node = nodes.size();
+        nodes[parent].children[function] = node;
+        nodes.push_back(Node(function, parent));
+    } else {
+        node = it->second;
+    }
+
+    Frame frame;
+    frame.function = function;
+    frame.stats = &stats;
+    frame.node = node;
+    frames.push_back(frame);
+}
+
+void Profiler::leave()
+{
+    auto stats = frames.back().stats;
+    if(--stats->active == 0)
+        stats->time += Clock::now() - stats->start;
+    frames.pop_back();
+}
+
+void Profiler::unwind()
+{
+    while(!frames.empty())
+        leave();
+}
+
+std::size_t Profiler::instructionCount() const
+{
+    std::size_t n = 0;
+    for(auto count : opcodes)
+        n += count;
+    return n;
+}
+
+string Profiler::label(const Function *function)
+{
+    std::ostringstream os;
+    os << function->getName() << "@" << (function->codeSize() ? function->getLine(0) : 0);
+    return os.str();
+}
+
+string Profiler::stack(int i) const
+{
+    string s = label(nodes[i].function);
+    for(int p = nodes[i].parent; p > 0; p = nodes[p].parent)
+        s = label(nodes[p].function) + ";" + s;
+    return s;
+}
+
+void Profiler::report(ostream &os) const
+{
+    os << "----------PROFILE----------\n";
+
+    std::vector<std::pair<std::size_t, int>> ops;
+    for(std::size_t i = 0; i < opcodes.size(); ++i)
+        if(opcodes[i])
+            ops.push_back(std::make_pair(opcodes[i], (int)i));
+    std::sort(ops.rbegin(), ops.rend());
+    os << std::left << std::setw(24) << "Opcode" << "Count\n";
+    for(auto &op : ops)
+        os << std::setw(24) << opdesc[op.second] << op.first << "\n";
+
+    // Functions and lines in order of their instruction counts
+    struct Line {
+        std::size_t count;
+        const Function *function;
+        int line;
+    };
+    std::vector<std::pair<std::size_t, const Function *>> order;
+    std::vector<Line> lines;
+    for(auto &f : functions) {
+        std::size_t total = 0;
+        std::map<int, std::size_t> byLine;
+        for(std::size_t pc = 0; pc < f.second.counts.size(); ++pc) {
+            if(!f.second.counts[pc] || pc >= f.first->codeSize())
+                continue;
+            total += f.second.counts[pc];
+            byLine[f.first->getLine(pc)] += f.second.counts[pc];
+        }
+        order.push_back(std::make_pair(total, f.first));
+        for(auto &l : byLine)
+            lines.push_back(Line{l.second, f.first, l.first});
+    }
+    std::sort(order.rbegin(), order.rend());
+    std::stable_sort(lines.begin(), lines.end(), [](const Line &a, const Line &b) {
+        return a.count > b.count;
+    });
+
+    os << "\n" << std::setw(24) << "Function" << std::setw(12) << "Calls"
+       << std::setw(16) << "Instructions" << "Time(ms)\n";
+    for(auto &f : order) {
+        auto &stats = functions.find(const_cast<Function *>(f.second))->second;
+        os << std::setw(24) << label(f.second) << std::setw(12) << stats.calls
+           << std::setw(16) << f.first
+           << std::chrono::duration<double, std::milli>(stats.time).count() << "\n";
+    }
+
+    os << "\n" << std::setw(24) << "Function" << std::setw(12) << "Line" << "Instructions\n";
+    for(std::size_t i = 0; i < lines.size() && i < PROFILE_LINE_LIMIT; ++i)
+        os << std::setw(24) << label(lines[i].function) << std::setw(12) << lines[i].line
+           << lines[i].count << "\n";
+    os << std::right;
+}
+
+void Profiler::writeFoldedStacks(ostream &os) const
+{
+    for(std::size_t i = 1; i < nodes.size(); ++i)
+        if(nodes[i].count)
+            os << stack(i) << " " << nodes[i].count << "\n";
+}
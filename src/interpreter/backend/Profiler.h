@@ -0,0 +1,110 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "Function.h"
+#include "Code.h"
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+using std::ostream;
+
+// Count of opcodes, including superinstructions and typed codes
+#define OPCODE_COUNT (sizeof(opdesc) / sizeof(opdesc[0]))
+// Source lines printed in the report, the hottest first
+#define PROFILE_LINE_LIMIT 20
+
+// Execution profile collected by the VM: instruction counts per opcode,
+// per function and per source line, call counts and inclusive time per
+// function, and instruction counts per call stack for flame graphs.
+// Functions are labeled by name and the line of their first code.
+class Profiler {
+public:
+    Profiler();
+
+    // A new frame of function starts
+    void enter(Function *function);
+    // The current frame returns
+    void leave();
+    // Close the frames an error left open
+    void unwind();
+
+    // The code at index pc of the current function runs
+    void count(int pc, Code::OpCode op) {
+        ++opcodes[op];
+        auto &frame = frames.back();
+        ++frame.stats->counts[pc];
+        ++nodes[frame.node].count;
+    }
+
+    // Drop all counts
+    void reset();
+
+    // Count of codes run
+    std::size_t instructionCount() const;
+
+    // Print opcode, function and line tables
+    void report(ostream &os) const;
+    // Write instruction counts per call stack in the folded format of
+    // flamegraph.pl, e.g. "main@1;fib@2 120"
+    void writeFoldedStacks(ostream &os) const;
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct FunctionStats {
+        std::size_t calls;
+        // Executions of each code
+        std::vector<std::size_t> counts;
+        // Frames open, time is only taken by the outermost one so that
+        // recursion is not counted twice
+        int active;
+        Clock::time_point start;
+        Clock::duration time;
+
+        FunctionStats(): calls(0), active(0), time(Clock::duration::zero()) {}
+    };
+
+    // Call tree node, one per distinct stack. Node 0 is the root.
+    struct Node {
+        Function *function;
+        int parent;
+        // Instructions run with exactly this stack
+        std::size_t count;
+        std::unordered_map<Function *, int> children;
+
+        Node(Function *function, int parent): function(function), parent(parent), count(0) {}
+    };
+
+    struct Frame {
+        Function *function;
+        FunctionStats *stats;
+        int node;
+    };
+
+    static string label(const Function *function);
+    // Stack of node i, outermost first
+    string stack(int i) const;
+
+    std::vector<std::size_t> opcodes;
+    std::unordered_map<Function *, FunctionStats> functions;
+    std::vector<Node> nodes;
+    std::vector<Frame> frames;
+};
+
+#endif /* PROFILER_H */
@@ -14,9 +14,13 @@
 // along with this program.  If nOperand::, see <http://www.gnu.org/licenses/>.
 
 #include "VM.h"
+#include "Parse.h"
 #include <iostream>
+#include <new>
+#include <cmath>
+#include <climits>
 
-VM::VM()
+VM::VM(): profiler(nullptr), tracing(true)
 {
     // Initialize registers
     registers.resize(MINIMUM_REGISTER_SIZE);
@@ -25,188 +29,646 @@ VM::VM()
 void VM::load(Function *mfunc)
 {
     mfunction = mfunc;
+    memos.clear();
+    memoKeys.clear();
     registers.resize(mfunction->slotCount() + 1);
     // Create closure for main function
     auto closure = createClosure(mfunction);
     registers[0] = Operand(closure);
     // Create superior caller
     calls.push_back(CallInfo(0, 1, 1, mfunction->getBaseCode()));
+    countFrame(1 + mfunction->slotCount());
+}
+
+void VM::reset()
+{
+    calls.clear();
+    closures.clear();
+    sharedClosures.clear();
+    upvalues.clear();
+    memos.clear();
+    memoKeys.clear();
+    allocator.reset();
+    frames.reset();
+    registers.clear();
+    registers.resize(MINIMUM_REGISTER_SIZE);
 }
 
 void VM::run()
 {
+    auto start = std::chrono::steady_clock::now();
     try {
-        std::cout << "--------BEGINNING OF PROGRAM--------\n";
-        showRuntimeStack();
-        while (!calls.empty()) {
-            bool finish = false;
-            while (!finish) {
-                auto function = getCurrentClosure()->getPrototype();
-                auto baseCode = function->getBaseCode();
-
-                Code::OpCode op = calls.back().pc->op;
-                int arg1 = calls.back().pc->arg1;
-                int arg2 = calls.back().pc->arg2;
-                int result = calls.back().pc->result;
-
-                calls.back().pc++;
-
-                std::cout << "\nOP:" << opdesc[op]
-                             << "\targ1:" << arg1
-                             << "\targ2:" << arg2
-                             << "\tresult:" << result << std::endl;
-
-                switch (op) {
-                case Code::Add:
-                    R(result) = RK(arg1) + RK(arg2);
-                    calls.back().adjustTopIndex(result);
-                    break;
-                case Code::Sub:
-                    R(result) = RK(arg1) - RK(arg2);
-                    calls.back().adjustTopIndex(result);
-                    break;
-                case Code::Mul:
-                    R(result) = RK(arg1) * RK(arg2);
-                    calls.back().adjustTopIndex(result);
-                    break;
-                case Code::Div:
-                    R(result) = RK(arg1) / RK(arg2);
-                    calls.back().adjustTopIndex(result);
-                    break;
-                case Code::Pow:
-                    R(result) = pow(RK(arg1), RK(arg2));
-                    calls.back().adjustTopIndex(result);
-                    break;
-                case Code::Minus:
-                    R(result) = -RK(arg1);
-                    calls.back().adjustTopIndex(result);
-                    break;
-                case Code::Jmp:
-                    calls.back().pc = baseCode + result;
-                    break;
-                case Code::Jnz:
-                    if (!(RK(arg1).isFalse()))
-                        calls.back().pc = baseCode + result;
-                    break;
-                case Code::Jgt:
-                    if (RK(arg1) > RK(arg2))
-                        calls.back().pc = baseCode + result;
-                    break;
-                case Code::Jge:
-                    if (RK(arg1) >= RK(arg2))
-                        calls.back().pc = baseCode + result;
-                    break;
-                case Code::Jlt:
-                    if (RK(arg1) < RK(arg2))
-                        calls.back().pc = baseCode + result;
-                    break;
-                case Code::Jle:
-                    if (RK(arg1) <= RK(arg2))
-                        calls.back().pc = baseCode + result;
-                    break;
-                case Code::Jeq:
-                    if (RK(arg1) == RK(arg2))
-                        calls.back().pc = baseCode + result;
-                    break;
-                case Code::Jne:
-                    if (RK(arg1) != RK(arg2))
-                        calls.back().pc = baseCode + result;
-                    break;
-                case Code::Move:
-                    R(result) = RK(arg1);
-                    calls.back().adjustTopIndex(result);
-                    break;
-                case Code::Closure:
-                    R(result) = Operand(createClosure(getCurrentClosure()->getPrototype()->getChild(arg1)));
-                    calls.back().adjustTopIndex(result);
-                    break;
-                case Code::SetUpval:
-                    setUpvalue(result, RK(arg1));
-                    break;
-                case Code::GetUpval:
-                    R(result) = getUpvalue(arg1);
-                    calls.back().adjustTopIndex(result);
-                    break;
-                case Code::Call:
-                    callClosure(arg1, arg2, result);
-                    break;
-                case Code::Return:
-                    callReturn(arg1, arg2);
-                    finish = true;
-                    break;
-                case Code::Nil:
-                    for(int i = arg1; i < arg2; ++i)
-                        R(i).setNil();
-                    calls.back().adjustTopIndex(arg1 + arg2 - 1);
-                    break;
-                case Code::ForPrep:
-                    R(arg1+3) = R(arg1) - R(arg1+2);
-                    calls.back().pc = baseCode + result;
-                    break;
-                case Code::ForLoop:
-                    R(arg1+3) = R(arg1+3) + R(arg1+2);
-                    if((R(arg1) <= R(arg1+3) && R(arg1+3) <= R(arg1+1)) ||(R(arg1) >= R(arg1+3) && R(arg1+3) >= R(arg1+1)))
-                        calls.back().pc = baseCode + result;
-                    break;
-                case Code::Bool:
-                    R(result) = Operand(arg1);
-                    calls.back().adjustTopIndex(result);
-                    break;
-                default:
-                    throw "Invalid opcode";
-                    break;
-                } // switch
-                if(!calls.empty())
-                    showRuntimeStack();
-                else
-                    std::cout << "----------END OF PROGRAM----------\n";
-            } // while
-        } // while
+        if(tracing) {
+            std::cout << "--------BEGINNING OF PROGRAM--------\n";
+            showRuntimeStack();
+        }
+        execute(0);
     }
     catch(const char *msg) {
+        if(profiler)
+            profiler->unwind();
         std::cout << msg << std::endl;
     }
+    countEvaluation(start);
+}
+
+void VM::countEvaluation(std::chrono::steady_clock::time_point start)
+{
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    stats.runTime += ns;
+    stats.latency.observe(ns);
+}
+
+RuntimeStats VM::getStats() const
+{
+    RuntimeStats s = stats;
+    s.closuresLive = closures.size();
+    for(auto &call: calls)
+        s.closuresLive += call.frameClosures;
+    s.upvaluesLive = upvalues.size();
+    return s;
+}
+
+// Run codes until the frame stack shrinks to depth frames. Calls from
+// native functions run a nested loop, returning once their callee does.
+void VM::execute(std::size_t depth)
+{
+    if(profiler && tracing)
+        dispatch<true, true>(depth);
+    else if(profiler)
+        dispatch<true, false>(depth);
+    else if(tracing)
+        dispatch<false, true>(depth);
+    else
+        dispatch<false, false>(depth);
+}
+
+// Every loop starts with a frame just pushed, by load(), callback() or
+// call(), and each Call pushing a frame is matched by a Return
+template<bool profiling, bool tracing>
+void VM::dispatch(std::size_t depth)
+{
+    if(profiling)
+        profiler->enter(getCurrentClosure()->getPrototype());
+    while (calls.size() > depth) {
+        auto function = getCurrentClosure()->getPrototype();
+        auto baseCode = function->getBaseCode();
+        if(profiling)
+            profiler->count(calls.back().pc - baseCode, calls.back().pc->op);
+        ++stats.instructions;
+
+        Code::OpCode op = calls.back().pc->op;
+        int arg1 = calls.back().pc->arg1;
+        int arg2 = calls.back().pc->arg2;
+        int result = calls.back().pc->result;
+
+        calls.back().pc++;
+
+        if(tracing)
+            std::cout << "\nOP:" << opdesc[op]
+                         << "\targ1:" << arg1
+                         << "\targ2:" << arg2
+                         << "\tresult:" << result << std::endl;
+
+        switch (op) {
+        case Code::Add:
+            R(result) = RK(arg1) + RK(arg2);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Sub:
+            R(result) = RK(arg1) - RK(arg2);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Mul:
+            R(result) = RK(arg1) * RK(arg2);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Div:
+            R(result) = RK(arg1) / RK(arg2);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Pow:
+            R(result) = pow(RK(arg1), RK(arg2));
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Minus:
+            R(result) = -RK(arg1);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Jmp:
+            calls.back().pc = baseCode + result;
+            break;
+        case Code::Jnz:
+            if (!(RK(arg1).isFalse()))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Jgt:
+            if (RK(arg1) > RK(arg2))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Jge:
+            if (RK(arg1) >= RK(arg2))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Jlt:
+            if (RK(arg1) < RK(arg2))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Jle:
+            if (RK(arg1) <= RK(arg2))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Jeq:
+            if (RK(arg1) == RK(arg2))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Jne:
+            if (RK(arg1) != RK(arg2))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Move:
+            R(result) = RK(arg1);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Closure:
+            R(result) = Operand(createClosure(getCurrentClosure()->getPrototype()->getChild(arg1)));
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::ClosureLocal:
+            R(result) = Operand(createLocalClosure(function->getChild(arg1), arg2));
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::SetUpval:
+            setUpvalue(result, RK(arg1));
+            break;
+        case Code::GetUpval:
+            R(result) = getUpvalue(arg1);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Call:
+            if(profiling) {
+                auto n = calls.size();
+                callClosure(arg1, arg2, result);
+                if(calls.size() > n)
+                    profiler->enter(getCurrentClosure()->getPrototype());
+            } else {
+                callClosure(arg1, arg2, result);
+            }
+            break;
+        case Code::Return:
+            if(profiling)
+                profiler->leave();
+            callReturn(arg1, arg2);
+            break;
+        case Code::Nil:
+            for(int i = arg1; i < arg1 + arg2; ++i)
+                R(i).setNil();
+            calls.back().adjustTopIndex(arg1 + arg2 - 1);
+            break;
+        case Code::ForPrep:
+            R(arg1+3) = R(arg1) - R(arg1+2);
+            calls.back().pc = baseCode + result;
+            break;
+        case Code::ForLoop:
+            if(R(arg1).type == Operand::RealType && R(arg1+1).type == Operand::RealType
+                    && R(arg1+2).type == Operand::RealType && R(arg1+3).type == Operand::RealType) {
+                // Same test as below without going through Operand
+                double start = R(arg1).real, end = R(arg1+1).real;
+                double i = R(arg1+3).real += R(arg1+2).real;
+                if((!(start > i) && !(i > end)) || ((start == i || start > i) && (i == end || i > end)))
+                    calls.back().pc = baseCode + result;
+                break;
+            }
+            R(arg1+3) = R(arg1+3) + R(arg1+2);
+            if((R(arg1) <= R(arg1+3) && R(arg1+3) <= R(arg1+1)) ||(R(arg1) >= R(arg1+3) && R(arg1+3) >= R(arg1+1)))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::ForPrepInt:
+            if(!arg2)
+                R(arg1+1) = Operand(forTripCount(R(arg1).integer, R(arg1+1), R(arg1+2).integer));
+            R(arg1+3) = Operand(R(arg1).integer - R(arg1+2).integer);
+            calls.back().pc = baseCode + result;
+            break;
+        case Code::ForLoopInt:
+            if(R(arg1+1).integer > 0) {
+                --R(arg1+1).integer;
+                R(arg1+3).integer += R(arg1+2).integer;
+                calls.back().pc = baseCode + result;
+            }
+            break;
+        case Code::Bool:
+            R(result) = Operand(arg1);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Lt:
+            R(result) = Operand(RK(arg1) < RK(arg2) ? 1 : 0);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Le:
+            R(result) = Operand(RK(arg1) <= RK(arg2) ? 1 : 0);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Gt:
+            R(result) = Operand(RK(arg1) > RK(arg2) ? 1 : 0);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Ge:
+            R(result) = Operand(RK(arg1) >= RK(arg2) ? 1 : 0);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Eq:
+            R(result) = Operand(RK(arg1) == RK(arg2) ? 1 : 0);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Ne:
+            R(result) = Operand(RK(arg1) != RK(arg2) ? 1 : 0);
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::Jnlt:
+            if (!(RK(arg1) < RK(arg2)))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Jnle:
+            if (!(RK(arg1) <= RK(arg2)))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Jngt:
+            if (!(RK(arg1) > RK(arg2)))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Jnge:
+            if (!(RK(arg1) >= RK(arg2)))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Jz:
+            if (RK(arg1).isFalse())
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::Move2:
+            R(result) = RK(arg1);
+            R(result + 1) = RK(arg2);
+            calls.back().adjustTopIndex(result + 1);
+            break;
+        case Code::AddI:
+            setInteger(result, RK(arg1).integer + RK(arg2).integer);
+            break;
+        case Code::SubI:
+            setInteger(result, RK(arg1).integer - RK(arg2).integer);
+            break;
+        case Code::MulI:
+            setInteger(result, RK(arg1).integer * RK(arg2).integer);
+            break;
+        case Code::AddR:
+            setReal(result, RK(arg1).real + RK(arg2).real);
+            break;
+        case Code::SubR:
+            setReal(result, RK(arg1).real - RK(arg2).real);
+            break;
+        case Code::MulR:
+            setReal(result, RK(arg1).real * RK(arg2).real);
+            break;
+        case Code::DivR:
+            setReal(result, RK(arg1).real / RK(arg2).real);
+            break;
+        case Code::JltI:
+            if (RK(arg1).integer < RK(arg2).integer)
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::JleI:
+            if (RK(arg1).integer <= RK(arg2).integer)
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::JgtI:
+            if (RK(arg1).integer > RK(arg2).integer)
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::JgeI:
+            if (RK(arg1).integer >= RK(arg2).integer)
+                calls.back().pc = baseCode + result;
+            break;
+        // Like Operand comparisons, less tests are false for NaN
+        // only through the negation of the other test
+        case Code::JltR:
+            if (!(RK(arg1).real >= RK(arg2).real))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::JleR:
+            if (!(RK(arg1).real > RK(arg2).real))
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::JgtR:
+            if (RK(arg1).real > RK(arg2).real)
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::JgeR:
+            if (RK(arg1).real >= RK(arg2).real)
+                calls.back().pc = baseCode + result;
+            break;
+        case Code::NewArray:
+            R(result) = Operand(newArray(arg1, arg2));
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::GetIndex:
+            if (R(arg1).type != Operand::ArrayType)
+                throw "Index non-array value";
+            R(result) = R(arg1).array->get(RK(arg2));
+            calls.back().adjustTopIndex(result);
+            break;
+        case Code::SetIndex:
+            if (R(arg1).type != Operand::ArrayType)
+                throw "Index non-array value";
+            R(arg1).array->set(RK(arg2), RK(result));
+            break;
+        default:
+            throw "Invalid opcode";
+            break;
+        } // switch
+        if(!tracing)
+            continue;
+        if(!calls.empty())
+            showRuntimeStack();
+        else
+            std::cout << "----------END OF PROGRAM----------\n";
+    } // while
+}
+
+// Integer counters never stop between two integers, so a real end is
+// rounded towards the start
+static int realTripCount(int start, double end, int step)
+{
+    double bound = step > 0 ? std::floor(end) : std::ceil(end);
+    if(!(bound <= INT_MAX))
+        bound = INT_MAX;
+    else if(bound < INT_MIN)
+        bound = INT_MIN;
+    return Code::tripCount(start, (int)bound, step);
+}
+
+// Trip count of an integer for loop whose end is only known at runtime.
+// Dual ends, like parameters of gradient calls, compare by their value.
+int VM::forTripCount(int start, const Operand &end, int step)
+{
+    switch(end.type) {
+    case Operand::IntegerType:
+        return Code::tripCount(start, end.integer, step);
+    case Operand::RealType:
+        return realTripCount(start, end.real, step);
+    case Operand::DualType:
+        return realTripCount(start, end.dual->getValue(), step);
+    default:
+        throw "invalid operands type in comparison";
+    }
+}
+
+// Functions of lazy parses are compiled on their first call
+static void compile(Function *function)
+{
+    if(function->isDeferred() && !compileDeferred(function))
+        throw "Invalid function body";
 }
 
 // CALL A B C -- R(A), ... ,R(A+C-1) = R(A)(R(A+1), ... ,R(A+B))
 // wherein, A -- i, B -- nparams, C -- nresults
 void VM::callClosure(int i, int nparams, int nresults)
 {
+    ++stats.calls;
+    if(R(i).type == Operand::NativeType) {
+        callNative(i, nparams, nresults);
+        return;
+    }
     if(R(i).type != Operand::ClosureType)
         throw "Call a non-closure type";
 
     auto function = R(i).closure->getPrototype();
+    compile(function);
     auto code = function->getBaseCode();
-    registers.resize(calls.back().topIndex + 256);
-    //std::cout << "capacity:" << registers.capacity() << std::endl;
+
+    // Pure functions called again with the same numeric arguments return
+    // the stored result like a native function, without a frame
+    Memo *memo = nullptr;
+    if(function->isPure() && nparams == function->paramCount() && Memo::isKey(&R(i) + 1, nparams)) {
+        memo = &memos[function];
+        auto result = memo->find(&R(i) + 1, nparams);
+        if(result) {
+            auto &caller = calls.back();
+            R(i) = *result;
+            caller.adjustTopIndex(i + (nresults > 1 ? nresults : 1) - 1);
+            for(int r = caller.baseIndex + i + 1; r < caller.topIndex; ++r)
+                registers[r].setNil();
+            return;
+        }
+        memoKeys.push_back(MemoKey(&R(i) + 1, nparams));
+    }
 
     int closureIndex = calls.back().baseIndex + i;
+    // Grow the stack to hold the callee frame, it is never shrunk
+    std::size_t needed = closureIndex + 1 + function->slotCount();
+    if(registers.size() < needed)
+        registers.resize(needed + MINIMUM_REGISTER_SIZE);
+
     int baseIndex = closureIndex + 1;
     int topIndex = calls.back().topIndex;
     calls.back().adjustTopIndex(i + nresults - 1);
     calls.push_back(CallInfo(closureIndex, baseIndex, topIndex, code));
+    calls.back().memo = memo;
+    countFrame(needed);
+}
+
+// Native functions read their arguments where the call placed them and
+// need neither a CallInfo nor a larger stack. Like callReturn, the result
+// goes to register i and the registers above it up to the top are nil.
+void VM::callNative(int i, int nparams, int nresults)
+{
+    auto &call = calls.back();
+    int nargs = nparams;
+    if(nargs == -1) {
+        // Arguments end at the top, trailing nils are missing arguments
+        nargs = call.topIndex - (call.baseIndex + i + 1);
+        while(nargs > 0 && R(i + nargs).isNil())
+            --nargs;
+    }
+
+    Operand value = R(i).native(*this, &R(i) + 1, nargs);
+    // Callbacks of the native function may have moved the frames
+    auto &caller = calls.back();
+    R(i) = value;
+    caller.adjustTopIndex(i + (nresults > 1 ? nresults : 1) - 1);
+    for(int r = caller.baseIndex + i + 1; r < caller.topIndex; ++r)
+        registers[r].setNil();
+}
+
+Callback VM::prepareCallback(const Operand &f, int nargs)
+{
+    Callback callback;
+    callback.function = f;
+    callback.closureIndex = -1;
+    if(f.type == Operand::NativeType)
+        return callback;
+    if(f.type != Operand::ClosureType)
+        throw "Call a non-closure type";
+
+    auto function = f.closure->getPrototype();
+    compile(function);
+    callback.closureIndex = calls.back().topIndex;
+    int slots = function->slotCount() > nargs ? function->slotCount() : nargs;
+    std::size_t needed = callback.closureIndex + 1 + slots;
+    if(registers.size() < needed)
+        registers.resize(needed + MINIMUM_REGISTER_SIZE);
+    return callback;
+}
+
+// Like CALL followed by RETURN of the callee, without going through the
+// dispatch loop for the call itself. The frame stays at the same place
+// for every call.
+Operand VM::callback(const Callback &callback, const Operand *args, int nargs)
+{
+    ++stats.calls;
+    if(callback.function.type == Operand::NativeType)
+        return callback.function.native(*this, args, nargs);
+
+    int closureIndex = callback.closureIndex;
+    registers[closureIndex] = callback.function;
+    for(int i = 0; i < nargs; ++i)
+        registers[closureIndex + 1 + i] = args[i];
+
+    auto depth = calls.size();
+    auto function = callback.function.closure->getPrototype();
+    int slots = function->slotCount() > nargs ? function->slotCount() : nargs;
+    calls.push_back(CallInfo(closureIndex, closureIndex + 1, closureIndex + 1 + nargs,
+                             function->getBaseCode()));
+    countFrame(closureIndex + 1 + slots);
+    execute(depth);
+    return registers[closureIndex];
+}
+
+Operand VM::call(Function *function, const Operand *args, int nargs)
+{
+    auto start = std::chrono::steady_clock::now();
+    compile(function);
+    mfunction = function;
+    int slots = function->slotCount() > nargs ? function->slotCount() : nargs;
+    if(registers.size() < (std::size_t)slots + 1)
+        registers.resize(slots + 1);
+    registers[0] = Operand(createClosure(function));
+    for(int i = 0; i < nargs; ++i)
+        registers[1 + i] = args[i];
+
+    calls.push_back(CallInfo(0, 1, 1 + nargs, function->getBaseCode()));
+    countFrame(slots + 1);
+    try {
+        execute(0);
+    }
+    catch(const char *) {
+        // Unwind the frames left by the error, upvalues still open refer
+        // to registers the next call overwrites
+        for(auto upvalue: upvalues) {
+            if(upvalue->isopen) {
+                upvalue->isopen = false;
+                upvalue->value = registers[upvalue->index];
+            }
+        }
+        if(profiler)
+            profiler->unwind();
+        calls.clear();
+        memoKeys.clear();
+        frames.release(StackAllocator::Mark());
+        countEvaluation(start);
+        throw;
+    }
+    countEvaluation(start);
+    return registers[0];
+}
+
+Array *VM::createArray(Operand::OperandType type, int length)
+{
+    return Array::create(type, length, allocator);
+}
+
+Dual *VM::createDual(double value, int n)
+{
+    return Dual::create(value, n, allocator);
+}
+
+Array *VM::newArray(int i, int n)
+{
+    auto type = Operand::IntegerType;
+    for(int k = 0; k < n; ++k) {
+        auto t = R(i + k).type;
+        if(t == Operand::RealType)
+            type = Operand::RealType;
+        else if(t != Operand::IntegerType)
+            throw "Invalid element type of array";
+    }
+
+    auto array = createArray(type, n);
+    for(int k = 0; k < n; ++k)
+        array->set(Operand(k + 1), R(i + k));
+    return array;
 }
 
 Closure *VM::createClosure(Function * function)
 {
-    auto closure = new Closure(function);
+    auto count = function->upvalueCount();
+    if(count == 0) {
+        auto &shared = sharedClosures[function];
+        if(!shared) {
+            shared = Closure::create(function, allocator);
+            closures.push_back(shared);
+            ++stats.closuresCreated;
+        }
+        return shared;
+    }
+
+    auto closure = Closure::create(function, allocator);
     closures.push_back(closure);
+    ++stats.closuresCreated;
 
     // setup upvalues
-    auto count = function->upvalueCount();
     for (std::size_t i = 0; i < count; ++i) {
         auto upvalueInfo = function->getUpvalueInfo(i);
 
         if (upvalueInfo->isParentLocal) {
             int registerIndex = calls.back().baseIndex + upvalueInfo->registerIndex;
-            int index;
-            if((index = findUpvalue(registerIndex)) == -1) {
-                index = addUpvalue(registerIndex);
+            Upvalue *upvalue;
+            if((upvalue = findUpvalue(registerIndex)) == nullptr) {
+                upvalue = addUpvalue(registerIndex);
             }
-            closure->addUpvalueIndex(index);
+            closure->setUpvalue(i, upvalue);
         } else {
             // Get upvalue from parent upvalue list
-            closure->addUpvalueIndex(getCurrentClosure()->getUpvalueIndex(upvalueInfo->registerIndex));
+            closure->setUpvalue(i, getCurrentClosure()->getUpvalue(upvalueInfo->registerIndex));
+        }
+    }
+    return closure;
+}
+
+Closure *VM::createLocalClosure(Function * function, int offset)
+{
+    auto &call = calls.back();
+    if(!call.frameStorage) {
+        call.frameMark = frames.mark();
+        call.frameStorage = static_cast<char *>(frames.allocate(getCurrentClosure()->getPrototype()->frameStorageSize()));
+    }
+
+    // The closure is followed by its upvalue pointers and upvalues
+    auto count = function->upvalueCount();
+    char *memory = call.frameStorage + offset;
+    auto closure = Closure::createAt(memory, function);
+    ++stats.closuresCreated;
+    ++call.frameClosures;
+    auto locals = reinterpret_cast<Upvalue *>(memory + Closure::allocationSize(count));
+    for (int i = 0; i < count; ++i) {
+        auto upvalueInfo = function->getUpvalueInfo(i);
+
+        if (upvalueInfo->isParentLocal) {
+            auto upvalue = new(&locals[i]) Upvalue();
+            ++stats.upvaluesCreated;
+            upvalue->isopen = true;
+            upvalue->index = call.baseIndex + upvalueInfo->registerIndex;
+            closure->setUpvalue(i, upvalue);
+        } else {
+            closure->setUpvalue(i, getCurrentClosure()->getUpvalue(upvalueInfo->registerIndex));
         }
     }
     return closure;
@@ -224,6 +686,11 @@ void VM::callReturn(int start, int n)
     int closureIndex = calls.back().closureIndex;
     int baseIndex = calls.back().baseIndex;
     int topIndex = calls.back().topIndex;
+    if(calls.back().memo) {
+        if(n == 1)
+            calls.back().memo->store(memoKeys.back(), R(start));
+        memoKeys.pop_back();
+    }
     for(int i = 0; i < n; ++i) {
         registers[closureIndex+i] = R(start+i);
     }
@@ -233,9 +700,15 @@ void VM::callReturn(int start, int n)
         }
     }
     closeUpvalues();
+    if(calls.back().frameStorage)
+        frames.release(calls.back().frameMark);
     calls.pop_back();
-    // Set nils
-    if(calls.empty()) return;
+    // Set nils, the outermost frame returning nothing leaves a nil result
+    if(calls.empty()) {
+        if(n == 0)
+            registers[closureIndex].setNil();
+        return;
+    }
     topIndex = calls.back().topIndex;
     if(n!=-1)
     for(int i = closureIndex+n; i < topIndex; i++)
@@ -260,24 +733,25 @@ void VM::showRuntimeStack() const
 }
 
 // Check whether upvalue already exisited
-int VM::findUpvalue(int registerIndex)
+Upvalue *VM::findUpvalue(int registerIndex)
 {
     int n = upvalues.size();
     for(int i = n-1; i >= 0; --i) {
         if(upvalues[i]->isopen && upvalues[i]->index == registerIndex)
-            return i;
+            return upvalues[i];
     }
-    return -1;
+    return nullptr;
 }
 
 // Add upvalue
-int VM::addUpvalue(int registerIndex)
+Upvalue *VM::addUpvalue(int registerIndex)
 {
-    Upvalue *upvalue = new Upvalue();
+    Upvalue *upvalue = new(allocator.allocate(sizeof(Upvalue))) Upvalue();
     upvalue->isopen = true;
     upvalue->index = registerIndex;
     upvalues.push_back(upvalue);
-    return upvalues.size()-1;
+    ++stats.upvaluesCreated;
+    return upvalue;
 }
 
 // Close upvalues assocciated to current closure
@@ -18,8 +18,16 @@
 
 #include "Operand.h"
 #include "Function.h"
+#include "Array.h"
+#include "Dual.h"
+#include "Memo.h"
+#include "Profiler.h"
+#include "Metrics.h"
+#include "Allocator.h"
+#include <chrono>
 #include <vector>
 #include <list>
+#include <unordered_map>
 
 struct CallInfo {
     // Function/closure index int the stack
@@ -30,11 +38,21 @@ struct CallInfo {
     int topIndex;
     // Program counter, i.e. current code
     Code *pc;
+    // Storage of non-escaping closures, allocated on first use
+    char *frameStorage;
+    // Frame stack position before frameStorage was allocated
+    StackAllocator::Mark frameMark;
+    // Closures created in frameStorage, freed with it
+    int frameClosures;
+    // Memo table storing the result, null unless the call is memoized
+    Memo *memo;
 
-    CallInfo(): closureIndex(0), baseIndex(0), topIndex(0), pc(nullptr) {}
+    CallInfo(): closureIndex(0), baseIndex(0), topIndex(0), pc(nullptr), frameStorage(nullptr),
+        frameClosures(0), memo(nullptr) {}
 
     CallInfo(int closureIndex, int baseIndex, int topIndex, Code *pc)
-        : closureIndex(closureIndex), baseIndex(baseIndex), topIndex(topIndex), pc(pc){
+        : closureIndex(closureIndex), baseIndex(baseIndex), topIndex(topIndex), pc(pc),
+        frameStorage(nullptr), frameClosures(0), memo(nullptr) {
     }
 
     // Adjust topIndex while running
@@ -46,14 +64,19 @@ struct CallInfo {
 
 #define MINIMUM_REGISTER_SIZE 256
 
+// Function called repeatedly from a native function, either a closure
+// with its frame placed once or another native function
+struct Callback {
+    Operand function;
+    // Register(absolute) of the closure, its arguments follow
+    int closureIndex;
+};
+
 class VM {
 public:
     VM();
     ~VM() {
-        for(auto closure : closures)
-            delete closure;
-        for(auto upvalue : upvalues)
-            delete upvalue;
+        // Closures and upvalues are released with the allocator slabs
     }
 
     // Execute the code
@@ -62,12 +85,81 @@ public:
     void showRuntimeStack() const;
     // Load main function
     void load(Function *mfunc);
+    // Drop all runtime state, closures and upvalues are freed in bulk
+    void reset();
+
+    // Place the frame of closure f above the frame of the running function,
+    // so that callback can call it again and again. Arguments given to the
+    // native function calling this may move, read them before.
+    Callback prepareCallback(const Operand &f, int nargs);
+    // Call the function of callback with nargs arguments from a native
+    // function, return its first result
+    Operand callback(const Callback &callback, const Operand *args, int nargs);
+
+    // Call function as the outermost frame with nargs arguments and return
+    // its first result, nil if there is none. The machine must not be running. Closures, arrays
+    // and dual numbers of earlier calls stay valid.
+    Operand call(Function *function, const Operand *args, int nargs);
+
+    // Create array of length zero elements of type, arrays are freed in
+    // bulk like closures
+    Array *createArray(Operand::OperandType type, int length);
+
+    // Create dual number of value with n zero derivatives, dual numbers
+    // are freed in bulk like closures
+    Dual *createDual(double value, int n);
+
+    // Count executed codes, calls and time into profiler, null turns
+    // profiling off
+    void setProfiler(Profiler *profiler) {
+        this->profiler = profiler;
+    }
+
+    // Print each code executed and the runtime stack after it, on by
+    // default
+    void setTracing(bool tracing) {
+        this->tracing = tracing;
+    }
+
+    // Allocator of runtime objects, holding allocation statistics
+    const Allocator &getAllocator() const {
+        return allocator;
+    }
+
+    // Counters of this machine, with the live counts of now
+    RuntimeStats getStats() const;
+    // Zero all counters
+    void resetStats() {
+        stats = RuntimeStats();
+    }
+    // Add the time taken to compile a program run by this machine
+    void addCompileTime(std::uint64_t ns) {
+        stats.compileTime += ns;
+    }
 
 private:
+    // Run codes until the frame stack shrinks to depth frames
+    void execute(std::size_t depth);
+    // Dispatch loop of execute, instantiated with and without counting
+    // into the profiler and tracing so that they cost nothing when off
+    template<bool profiling, bool tracing> void dispatch(std::size_t depth);
     // Call function/closure at register i(relative to current base index)
     void callClosure(int i, int nparams, int nresults);
+    // Call native function at register i in the frame of the caller
+    void callNative(int i, int nparams, int nresults);
     // Return values at register i(relative to current base index)
     void callReturn(int i, int n);
+    // Trip count of FORPREPINT
+    static int forTripCount(int start, const Operand &end, int step);
+    // Count the frame just pushed, whose closure and slots end below top
+    void countFrame(std::size_t top) {
+        if(calls.size() > stats.maxCallDepth)
+            stats.maxCallDepth = calls.size();
+        if(top > stats.registerHighWater)
+            stats.registerHighWater = top;
+    }
+    // Count an evaluation which started at start
+    void countEvaluation(std::chrono::steady_clock::time_point start);
 
     // Register reference at index i(relative to base of current base index)
     Operand & R(std::size_t i) {
@@ -90,22 +182,38 @@ private:
         }
     }
 
+    // Store a number to register i, without copying a whole Operand
+    void setInteger(std::size_t i, int value) {
+        auto &r = R(i);
+        r.type = Operand::IntegerType;
+        r.integer = value;
+        calls.back().adjustTopIndex(i);
+    }
+
+    // Store a number to register i, without copying a whole Operand
+    void setReal(std::size_t i, double value) {
+        auto &r = R(i);
+        r.type = Operand::RealType;
+        r.real = value;
+        calls.back().adjustTopIndex(i);
+    }
+
     // Upvalue reference at index i of current function/closure
     void setUpvalue(int i, const Operand &value) {
-        i = getCurrentClosure()->getUpvalueIndex(i);
-        if(upvalues[i]->isopen)
-            registers[upvalues[i]->index] = value;
+        auto upvalue = getCurrentClosure()->getUpvalue(i);
+        if(upvalue->isopen)
+            registers[upvalue->index] = value;
         else
-            upvalues[i]->value = value;
+            upvalue->value = value;
     }
 
     // Upvalue reference at index i of current function/closure
     Operand getUpvalue(int i) const {
-        i = getCurrentClosure()->getUpvalueIndex(i);
-        if(upvalues[i]->isopen)
-            return registers[upvalues[i]->index];
+        auto upvalue = getCurrentClosure()->getUpvalue(i);
+        if(upvalue->isopen)
+            return registers[upvalue->index];
         else
-            return upvalues[i]->value;
+            return upvalue->value;
     }
 
     // Get current closure, i.e. activation record
@@ -113,9 +221,18 @@ private:
         return registers[calls.back().closureIndex].closure;
     }
 
-    // Create closure base on function
+    // Create closure base on function. Functions without upvalues
+    // share one closure per prototype.
     Closure *createClosure(Function * function);
 
+    // Create non-escaping closure at offset of current frame storage,
+    // its upvalues refer to the registers directly and are never closed
+    Closure *createLocalClosure(Function * function, int offset);
+
+    // Create array of the n values from register i, integer elements when
+    // all values are integers, otherwise real elements
+    Array *newArray(int i, int n);
+
     // Closure at index i
     const Closure *getClosure(std::size_t i) const;
 
@@ -125,24 +242,39 @@ private:
     }
 
     // Check whether upvalue already exisited
-    int findUpvalue(int registerIndex);
+    Upvalue *findUpvalue(int registerIndex);
 
     // Add upvalue
-    int addUpvalue(int registerIndex);
+    Upvalue *addUpvalue(int registerIndex);
 
     // Close upvalues assocciated to current closure
     void closeUpvalues();
 
     // Main fuction, starting point of the virtual machine
     Function *mfunction;
+    // Slab allocator of closures and upvalues
+    Allocator allocator;
+    // Frame storage of non-escaping closures
+    StackAllocator frames;
     // Runtime stack, registers of each function is one part of the stack.
     std::vector<Operand> registers;
     // Frame stack, informations of each function
     std::vector<CallInfo> calls;
     // Closures
     std::vector<Closure *> closures;
+    // Shared closures of prototypes without upvalues
+    std::unordered_map<Function *, Closure *> sharedClosures;
     // Upvalues
     std::vector<Upvalue *> upvalues;
+    // Profile being collected, null when profiling is off
+    Profiler *profiler;
+    bool tracing;
+    // Memo tables of pure functions, dropped when a program is loaded
+    std::unordered_map<Function *, Memo> memos;
+    // Arguments of the memoized calls running
+    std::vector<MemoKey> memoKeys;
+    // Counters, always collected
+    RuntimeStats stats;
 };
 
 #endif /* VM_H */
@@ -16,54 +16,76 @@
 #include "CodeGen.h"
 #include "Function.h"
 #include "Semantic.h"
+#include "Builtins.h"
 #include <string>
 #include <vector>
+#include <cctype>
 using std::string;
 using std::vector;
 
-bool retrieveSymbol(Function *function, SemanticInfo *info)
+// Upvalue of function for name, which is added with the chain of upvalues of
+// the functions in between when name is defined by an enclosing function.
+// Upvalues of a deferred function are fixed before its body is compiled,
+// so the search does not pass it.
+static int retrieveUpvalue(Function *function, const string &name)
 {
     int index;
-    if((index = function->getLocalSymbol(info->name)) != -1) {
-        info->index = index;
-        info->type = SemanticInfo::LocalSymbol;
-        return true;
-    } else if((index = function->findUpvalue(info->name)) != -1) {
-        info->index = index;
-        info->type = SemanticInfo::Upvalue;
-        return true;
-    }
+    if((index = function->findUpvalue(name)) != -1 || function->isDeferred())
+        return index;
 
     vector<Function *> funcs;
     funcs.push_back(function);
     auto p = function->getParent();
     while(p) {
-        if((index = p->getLocalSymbol(info->name)) != -1) {
+        if((index = p->getLocalSymbol(name)) != -1) {
             int i = funcs.size()-1;
-            index = funcs[i]->addUpvalueInfo(UpvalueInfo(info->name, true, index));
+            index = funcs[i]->addUpvalueInfo(UpvalueInfo(name, true, index));
             --i;
             for(; i >= 0; --i)
-                index = funcs[i]->addUpvalueInfo(UpvalueInfo(info->name, false, index));
-
-            info->index = index;
-            info->type = SemanticInfo::Upvalue;
-            return true;
-        } else if((index = p->findUpvalue(info->name)) != -1) {
+                index = funcs[i]->addUpvalueInfo(UpvalueInfo(name, false, index));
+            return index;
+        } else if((index = p->findUpvalue(name)) != -1) {
             for(int i = funcs.size()-1; i >= 0; --i)
-                index = funcs[i]->addUpvalueInfo(UpvalueInfo(info->name, false, index));
-
-            info->index = index;
-            info->type = SemanticInfo::Upvalue;
-            return true;
+                index = funcs[i]->addUpvalueInfo(UpvalueInfo(name, false, index));
+            return index;
+        } else if(p->isDeferred()) {
+            break;
         } else {
             funcs.push_back(p);
             p = p->getParent();
         }
     }
 
+    return -1;
+}
+
+bool retrieveSymbol(Function *function, SemanticInfo *info)
+{
+    int index;
+    if((index = function->getLocalSymbol(info->name)) != -1) {
+        info->index = index;
+        info->type = SemanticInfo::LocalSymbol;
+        return true;
+    } else if((index = retrieveUpvalue(function, info->name)) != -1) {
+        info->index = index;
+        info->type = SemanticInfo::Upvalue;
+        return true;
+    }
+
     return false;
 }
 
+bool retrieveBuiltin(Function *function, SemanticInfo *info)
+{
+    auto native = findBuiltin(info->name);
+    if(!native)
+        return false;
+
+    info->index = -(int)function->addConstant(Operand(native));
+    info->type = SemanticInfo::Constant;
+    return true;
+}
+
 bool enterSymbol(Function *function, SemanticInfo *info)
 {
     info->index = function->addLocalSymbolInfo(LocalSymbolInfo(info->name, function->localSymbolCount()));
@@ -72,27 +94,89 @@ bool enterSymbol(Function *function, SemanticInfo *info)
     return true;
 }
 
-void makeSequence(Function *function, Semantic *exprs, int lineno)
+void deferFunctionBody(Function *function, const string &body, int line)
 {
-    if(exprs->prev->info->type == SemanticInfo::FunctionCall) {
-        function->backpatch(exprs->prev->info->codeIndex, 1);
-        function->setTemp(exprs->prev->info->index+1);
-    } else if(exprs->prev->info->index < function->localSymbolCount()) {
-        if(exprs->prev->info->type != SemanticInfo::Boolean) {
-            int temp = function->newTemp();
-            function->addCode(Code(Code::Move, exprs->prev->info->index, 0, temp), lineno);
-            exprs->prev->info->index = temp;
+    static const char *keywords[] = {
+        "function", "for", "while", "if", "then", "else",
+        "do", "end", "return", "not", "and", "or"
+    };
+
+    // Every name of the body, including bodies of nested functions, which
+    // is defined by an enclosing function becomes an upvalue now
+    std::size_t i = 0, n = body.size();
+    while(i < n) {
+        std::size_t start = i;
+        char c = body[i];
+        if(c == '-' && i + 1 < n && body[i + 1] == '-') {
+            while(i < n && body[i] != '\n')
+                ++i;
+        } else if(isdigit(c)) {
+            while(i < n && (isalnum(body[i]) || body[i] == '.'))
+                ++i;
+        } else if(isalpha(c) || c == '_') {
+            while(i < n && (isalnum(body[i]) || body[i] == '_'))
+                ++i;
+            string name = body.substr(start, i - start);
+            bool keyword = false;
+            for(auto k : keywords)
+                keyword = keyword || name == k;
+            if(!keyword && function->getLocalSymbol(name) == -1)
+                retrieveUpvalue(function, name);
         } else {
-            int temp = function->newTemp();
-            int tend = function->addCode(Code(Code::Bool, 1, 0, temp), lineno);
-            int jend = function->addCode(Code(Code::Jmp, 0, 0, -1), lineno);
-            int fend = function->addCode(Code(Code::Bool, 0, 0, temp), lineno);
-            function->backpatch(exprs->prev->info->tc, tend);
-            function->backpatch(exprs->prev->info->fc, fend);
-            function->backpatch(jend);
-            exprs->prev->info->index = temp;
+            ++i;
         }
     }
+
+    // The stub stands for the body in analyses of the enclosing functions,
+    // which see that any of the upvalues may be assigned
+    int zero = -(int)function->addConstant(Operand(0));
+    for(int j = 0; j < function->upvalueCount(); ++j)
+        function->addCode(Code(Code::SetUpval, zero, 0, j), line);
+    function->addCode(Code(Code::Return, 0, 0, 0), line);
+    function->defer(body, line);
+}
+
+void makeSequence(Function *function, Semantic *exprs, int lineno)
+{
+    if(exprs->prev->info->type == SemanticInfo::FunctionCall
+            || exprs->prev->info->type == SemanticInfo::Boolean) {
+        codegenOperand(function, exprs->prev, lineno);
+    } else if(exprs->prev->info->index < function->localSymbolCount()) {
+        int temp = function->newTemp();
+        function->addCode(Code(Code::Move, exprs->prev->info->index, 0, temp), lineno);
+        exprs->prev->info->index = temp;
+    }
+}
+
+void codegenOperand(Function *function, Semantic *exp, int lineno)
+{
+    if(exp->info->type == SemanticInfo::FunctionCall) {
+        function->backpatch(exp->info->codeIndex, 1);
+        function->setTemp(exp->info->index+1);
+    } else if(exp->info->type == SemanticInfo::Boolean) {
+        codegenValue(function, exp, lineno);
+    }
+}
+
+int codegenRange(Function *function, Semantic *exprs, int lineno)
+{
+    int n = count(exprs);
+    int first = exprs->info->index;
+    auto exp = exprs;
+    bool inPlace = true;
+    for(int i = 0; i < n; ++i, exp = exp->next)
+        inPlace = inPlace && exp->info->index == first + i;
+    if(inPlace)
+        return first;
+
+    // A boolean value may be stored above the temperaries of its operands
+    first = function->newTemp();
+    for(int i = 1; i < n; ++i)
+        function->newTemp();
+    exp = exprs;
+    for(int i = 0; i < n; ++i, exp = exp->next)
+        function->addCode(Code(Code::Move, exp->info->index, 0, first + i), lineno);
+    return first;
 }
 
 void codegenAsgnStmt(Function *function, SemanticInfo *target, int index, int lineno)
@@ -102,11 +186,44 @@ void codegenAsgnStmt(Function *function, SemanticInfo *target, int index, int li
     } else if(target->type == SemanticInfo::LocalSymbol) {
         if(target->index != index)
             function->addCode(Code(Code::Move, index, 0, target->index), lineno);
+    } else if(target->type == SemanticInfo::Element) {
+        function->addCode(Code(Code::SetIndex, target->index, target->key, index), lineno);
     } else {
         throw "Invalid assignment statement";
     }
 }
 
+void codegenValue(Function *function, Semantic *exp, int lineno)
+{
+    auto info = exp->info;
+    int temp = function->newTemp();
+    int n = function->codeSize();
+
+    // A lone comparison was just emitted as a conditional jump followed by
+    // a jump to the false branch, replace both with a comparison to temp
+    if(info->tc == n - 2 && info->fc == n - 1) {
+        auto test = *function->getCode(info->tc);
+        auto op = Code::comparison(test.op);
+        if(op != Code::Nop && test.result == -1 && function->getCode(info->fc)->result == -1) {
+            function->removeLastCode();
+            function->removeLastCode();
+            function->addCode(Code(op, test.arg1, test.arg2, temp), lineno);
+            info->type = SemanticInfo::Expression;
+            info->index = temp;
+            return;
+        }
+    }
+
+    int tend = function->addCode(Code(Code::Bool, 1, 0, temp), lineno);
+    int jend = function->addCode(Code(Code::Jmp, 0, 0, -1), lineno);
+    int fend = function->addCode(Code(Code::Bool, 0, 0, temp), lineno);
+    function->backpatch(info->tc, tend);
+    function->backpatch(info->fc, fend);
+    function->backpatch(jend);
+    info->type = SemanticInfo::Expression;
+    info->index = temp;
+}
+
 void codegenBoolean(Function *function, Semantic *exp, int lineno)
 {
     if(exp->info->type != SemanticInfo::Boolean) {
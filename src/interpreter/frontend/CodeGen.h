@@ -16,23 +16,39 @@
 #ifndef CODEGEN_H
 #define CODEGEN_H
 
+#include <string>
+
 class Function;
 class SemanticInfo;
 class Semantic;
 
 // Retrieve defined symbol, either local symbol or upvalue
 bool retrieveSymbol(Function *function, SemanticInfo *info);
+// Retrieve builtin function as a constant of function
+bool retrieveBuiltin(Function *function, SemanticInfo *info);
 // Enter new symbol which is not defined
 bool enterSymbol(Function *function, SemanticInfo *info);
 
+// Compile the function from body on its first call. Names of body defined by
+// enclosing functions are bound to upvalues now and a stub is generated.
+void deferFunctionBody(Function *function, const std::string &body, int line);
+
 // Move the last expression value of s to temperaries.
 // All expression except the last expression of s are already temperaries.
 // If the last expression of s is FunctionCall, set its expected results count to 1
 // Note that function call is temperary value. Constants and locals will be moved to tempraries.
 void makeSequence(Function *function, Semantic *exprs, int lineno);
+// Make the value of exp usable as an operand: the expected results count
+// of FunctionCall is set to 1 and Boolean is stored to a temperary
+void codegenOperand(Function *function, Semantic *exp, int lineno);
+// Registers of the temperary values of exprs in a row. Values out of place
+// are moved to new temperaries, return the first register.
+int codegenRange(Function *function, Semantic *exprs, int lineno);
 
 // Translate as boolean expression
 void codegenBoolean(Function *function, Semantic *exp, int lineno);
+// Store the boolean expression exp to a new temperary as 1 or 0
+void codegenValue(Function *function, Semantic *exp, int lineno);
 
 void codegenAsgnStmt(Function *function, SemanticInfo *target, int index, int lineno);
 
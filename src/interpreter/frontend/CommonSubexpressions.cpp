@@ -0,0 +1,374 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Optimizer.h"
+#include "Function.h"
+#include <vector>
+#include <map>
+#include <tuple>
+
+// Expression of a code: opcode and value numbers of its operands
+typedef std::tuple<int, int, int> Expression;
+
+// Whether the code computes a value from its operands only, so a second
+// code with the same expression computes the same value
+static bool pure(Code::OpCode op)
+{
+    switch(op) {
+    case Code::Add:
+    case Code::Sub:
+    case Code::Mul:
+    case Code::Div:
+    case Code::Pow:
+    case Code::Mod:
+    case Code::Minus:
+    case Code::Lt:
+    case Code::Le:
+    case Code::Gt:
+    case Code::Ge:
+    case Code::Eq:
+    case Code::Ne:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool commutative(Code::OpCode op)
+{
+    return op == Code::Add || op == Code::Mul || op == Code::Eq || op == Code::Ne;
+}
+
+// Local value numbering, the expression DAG of each basic block. Every
+// value gets a number, equal numbers mean equal values. Expressions are
+// hash-consed by opcode and operand numbers, so recomputing one becomes a
+// move from the register still holding it, and uses of copies read the
+// original register. Calls, SetUpval and SetIndex may change upvalues and
+// array elements, which ends the reuse of GetUpval and GetIndex values.
+class ValueNumbering {
+public:
+    ValueNumbering(Function *function):function(function), next(0) {
+        n = function->codeSize();
+        top = function->slotCount();
+        fixed = function->outerLocalCount();
+
+        findCaptured(function, captured);
+
+        // Moves may only be removed when no code counts its operands up
+        // to the top register, which every written register may raise
+        removable = true;
+        for(int pc = 0; pc < n; ++pc) {
+            auto c = function->getCode(pc);
+            if((c->op == Code::Call || c->op == Code::Return) && c->arg2 == -1)
+                removable = false;
+        }
+    }
+
+    void run() {
+        targets.assign(n + 1, false);
+        for(int pc = 0; pc < n; ++pc) {
+            auto c = function->getCode(pc);
+            if(c->isJump() && c->result >= 0 && c->result <= n)
+                targets[c->result] = true;
+        }
+
+        dead.assign(n, false);
+        for(int pc = 0; pc < n; ++pc) {
+            if(pc == 0 || targets[pc])
+                startBlock();
+            number(pc);
+        }
+        if(removable) {
+            removeDeadMoves();
+            for(int pc = n - 1; pc >= 0; --pc)
+                if(dead[pc])
+                    function->replaceCode(pc, std::vector<Code>(), std::vector<int>());
+        }
+    }
+
+private:
+    // Nothing is known about registers entering a block
+    void startBlock() {
+        values.assign(top, 0);
+        for(int r = 0; r < top; ++r)
+            values[r] = newValue(r);
+        expressions.clear();
+    }
+
+    int newValue(int r) {
+        origin.push_back(r);
+        return next++;
+    }
+
+    // Value number of operand rk, constants are numbered once
+    int valueOf(int rk) {
+        if(rk >= 0)
+            return values[rk];
+        auto it = constants.find(rk);
+        if(it != constants.end())
+            return it->second;
+        return constants[rk] = newValue(rk);
+    }
+
+    // Operand holding value v: the constant or register given v first,
+    // otherwise the lowest register still holding it. Captured registers
+    // are skipped unless allowed, children may change them.
+    bool held(int v, int &rk, bool allowCaptured) const {
+        int r = origin[v];
+        if(r < 0 || (values[r] == v && (allowCaptured || !captured[r]))) {
+            rk = r;
+            return true;
+        }
+        for(r = 0; r < top; ++r) {
+            if(values[r] == v && (allowCaptured || !captured[r])) {
+                rk = r;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Read register operand rk from the holder of its value, so that
+    // moves copying it become dead
+    void substitute(int &rk, bool registerOnly = false) {
+        int h;
+        if(rk < 0 || !held(values[rk], h, false))
+            return;
+        if(h >= 0 || !registerOnly)
+            rk = h;
+    }
+
+    void define(int r, int v) {
+        if(r < top)
+            values[r] = v;
+    }
+
+    // Forget values other code may change
+    void forget(Code::OpCode op) {
+        for(auto it = expressions.begin(); it != expressions.end();) {
+            if(std::get<0>(it->first) == op)
+                it = expressions.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    void number(int pc) {
+        auto c = function->getCode(pc);
+        switch(c->op) {
+        case Code::Add:
+        case Code::Sub:
+        case Code::Mul:
+        case Code::Div:
+        case Code::Pow:
+        case Code::Mod:
+        case Code::Lt:
+        case Code::Le:
+        case Code::Gt:
+        case Code::Ge:
+        case Code::Eq:
+        case Code::Ne:
+        case Code::Jlt:
+        case Code::Jle:
+        case Code::Jgt:
+        case Code::Jge:
+        case Code::Jeq:
+        case Code::Jne:
+            substitute(c->arg1);
+            substitute(c->arg2);
+            break;
+        case Code::Minus:
+        case Code::Move:
+        case Code::Jnz:
+        case Code::SetUpval:
+            substitute(c->arg1);
+            break;
+        case Code::GetIndex:
+            substitute(c->arg1, true);
+            substitute(c->arg2);
+            break;
+        case Code::SetIndex:
+            substitute(c->arg1, true);
+            substitute(c->arg2);
+            substitute(c->result);
+            break;
+        default:
+            break;
+        }
+
+        if(pure(c->op) || c->op == Code::GetUpval || c->op == Code::GetIndex) {
+            bool binary = c->op != Code::Minus && c->op != Code::GetUpval;
+            int a = c->op == Code::GetUpval ? c->arg1 : valueOf(c->arg1);
+            int b = binary ? valueOf(c->arg2) : 0;
+            if(commutative(c->op) && b < a)
+                std::swap(a, b);
+            Expression e(c->op, a, b);
+            auto it = expressions.find(e);
+            if(it == expressions.end()) {
+                int v = newValue(c->result);
+                expressions[e] = v;
+                define(c->result, v);
+                return;
+            }
+            // Computed before, move it from where it is held
+            int h;
+            if(!held(it->second, h, true)) {
+                int v = newValue(c->result);
+                expressions[e] = v;
+                define(c->result, v);
+                return;
+            }
+            *c = Code(Code::Move, h, 0, c->result);
+        }
+
+        switch(c->op) {
+        case Code::Move: {
+            int v = valueOf(c->arg1);
+            if(values[c->result] == v)
+                dead[pc] = true;
+            define(c->result, v);
+            break;
+        }
+        case Code::Call:
+            forget(Code::GetUpval);
+            forget(Code::GetIndex);
+            for(int r = 0; r < top; ++r)
+                if(captured[r])
+                    define(r, newValue(r));
+            defineAll(*c);
+            break;
+        case Code::SetUpval:
+            forget(Code::GetUpval);
+            break;
+        case Code::SetIndex:
+            forget(Code::GetIndex);
+            break;
+        default:
+            defineAll(*c);
+            break;
+        }
+    }
+
+    // Registers written by c hold new values
+    void defineAll(const Code &c) {
+        std::vector<int> defs;
+        c.getDefs(defs, top);
+        for(auto r : defs)
+            define(r, newValue(r));
+    }
+
+    // Moves to registers nobody reads afterwards. Locals of the outermost
+    // scope and captured registers stay alive after the function returns.
+    void removeDeadMoves() {
+        std::vector<bool> exit(top, false);
+        for(int r = 0; r < top; ++r)
+            exit[r] = r < fixed || captured[r];
+
+        // Removing a move may make the moves feeding it dead too
+        bool removed = true;
+        while(removed) {
+            removed = false;
+            auto liveOut = liveness(exit);
+            for(int pc = 0; pc < n; ++pc) {
+                auto c = function->getCode(pc);
+                if(c->op == Code::Move && !dead[pc] && !liveOut[pc][c->result]) {
+                    dead[pc] = true;
+                    removed = true;
+                }
+            }
+        }
+    }
+
+    // Registers live after each code, codes marked dead are skipped
+    std::vector<std::vector<bool> > liveness(const std::vector<bool> &exit) const {
+        std::vector<std::vector<bool> > liveIn(n + 1, std::vector<bool>(top, false));
+        std::vector<std::vector<bool> > liveOut(n, std::vector<bool>(top, false));
+        liveIn[n] = exit;
+        std::vector<int> regs;
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            for(int pc = n - 1; pc >= 0; --pc) {
+                auto c = function->getCode(pc);
+                std::vector<bool> live(top, false);
+                if(c->fallsThrough())
+                    merge(live, liveIn[pc + 1]);
+                if(c->isJump() && c->result >= 0 && c->result <= n)
+                    merge(live, liveIn[c->result]);
+                if(c->op == Code::Return)
+                    merge(live, exit);
+                liveOut[pc] = live;
+
+                if(!dead[pc]) {
+                    regs.clear();
+                    c->getDefs(regs, top);
+                    for(auto r : regs)
+                        if(r < top)
+                            live[r] = false;
+                    regs.clear();
+                    c->getUses(regs, top);
+                    for(auto r : regs)
+                        if(r < top)
+                            live[r] = true;
+                    // Callees and closures read captured registers through
+                    // open upvalues
+                    if(c->op == Code::Call || c->op == Code::Closure || c->op == Code::ClosureLocal)
+                        merge(live, captured);
+                }
+                if(live != liveIn[pc]) {
+                    liveIn[pc] = live;
+                    changed = true;
+                }
+            }
+        }
+        return liveOut;
+    }
+
+    static void merge(std::vector<bool> &live, const std::vector<bool> &other) {
+        for(std::size_t r = 0; r < live.size(); ++r)
+            live[r] = live[r] || other[r];
+    }
+
+    Function *function;
+    // Count of codes
+    int n;
+    int top;
+    // Registers of outer scope locals
+    int fixed;
+    // Whether removing moves keeps the top register of variable counts
+    bool removable;
+    // Registers which children may assign through upvalues
+    std::vector<bool> captured;
+    // Codes which are targets of jumps, indexed by code
+    std::vector<bool> targets;
+    // Codes without effect, removed at the end
+    std::vector<bool> dead;
+    // Value number held by each register
+    std::vector<int> values;
+    // Register or constant given each value number first
+    std::vector<int> origin;
+    // Value numbers of constants
+    std::map<int, int> constants;
+    // Value numbers of expressions computed in the block
+    std::map<Expression, int> expressions;
+    // Next value number
+    int next;
+};
+
+void eliminateCommonSubexpressions(Function *function)
+{
+    ValueNumbering(function).run();
+}
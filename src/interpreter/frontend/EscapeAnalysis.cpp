@@ -0,0 +1,166 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Optimizer.h"
+#include "Function.h"
+#include <vector>
+
+// Registers which may hold the closure at a program point
+typedef std::vector<bool> HoldSet;
+
+// Whether a use of the registers in holds lets the closure escape.
+// Calling or testing the closure is fine, any other use is not.
+static bool escapingUse(const Code &c, const HoldSet &holds, int top)
+{
+    auto holding = [&holds](int i) {
+        return i >= 0 && i < (int)holds.size() && holds[i];
+    };
+
+    std::vector<int> uses;
+    switch(c.op) {
+    case Code::Move:
+    case Code::Jnz:
+    case Code::Jeq:
+    case Code::Jne:
+    case Code::Eq:
+    case Code::Ne:
+        return false;
+    case Code::Call: {
+        int end = c.arg2 == -1 ? top : c.arg1 + c.arg2 + 1;
+        for(int r = c.arg1 + 1; r < end; ++r)
+            if(holding(r))
+                return true;
+        return false;
+    }
+    default:
+        c.getUses(uses, top);
+        for(auto r : uses)
+            if(holding(r))
+                return true;
+        return false;
+    }
+}
+
+// Whether the closure created by the Closure instruction at pc may be used
+// after the frame of function is gone. Registers holding the closure are
+// tracked forward through moves until they are overwritten.
+static bool escapes(Function *function, int pc)
+{
+    auto code = function->getCode(pc);
+    auto prototype = function->getChild(code->arg1);
+
+    // Children of the closure sharing its upvalues would refer to
+    // upvalues in the frame storage, a deferred body may have such children
+    if(prototype->isDeferred() && prototype->upvalueCount() != 0)
+        return true;
+    for(std::size_t i = 0; i < prototype->childCount(); ++i) {
+        auto grandchild = prototype->getChild(i);
+        for(int j = 0; j < grandchild->upvalueCount(); ++j)
+            if(!grandchild->getUpvalueInfo(j)->isParentLocal)
+                return true;
+    }
+
+    int n = function->codeSize();
+    int top = function->slotCount();
+    for(int i = 0; i < n; ++i) {
+        auto c = function->getCode(i);
+        if(c->op != Code::Call && c->op != Code::Return && c->result >= top)
+            top = c->result + 1;
+    }
+
+    // Data flow over the control flow graph, the in-state of each code
+    std::vector<HoldSet> states(n, HoldSet(top, false));
+    std::vector<bool> reached(n, false);
+    std::vector<int> worklist;
+    worklist.push_back(pc);
+    reached[pc] = true;
+    std::vector<int> defs;
+    while(!worklist.empty()) {
+        int i = worklist.back();
+        worklist.pop_back();
+        auto c = function->getCode(i);
+        if(escapingUse(*c, states[i], top))
+            return true;
+
+        HoldSet out = states[i];
+        if(c->op == Code::Move) {
+            out[c->result] = c->arg1 >= 0 && states[i][c->arg1];
+        } else {
+            defs.clear();
+            c->getDefs(defs, top);
+            for(auto r : defs)
+                out[r] = false;
+        }
+        if(i == pc)
+            out[code->result] = true;
+
+        // Propagate to successors
+        int successors[2];
+        int m = 0;
+        if(c->fallsThrough() && i + 1 < n)
+            successors[m++] = i + 1;
+        if(c->isJump())
+            successors[m++] = c->result;
+        for(int k = 0; k < m; ++k) {
+            int s = successors[k];
+            bool changed = !reached[s];
+            reached[s] = true;
+            for(int r = 0; r < top; ++r) {
+                if(out[r] && !states[s][r]) {
+                    states[s][r] = true;
+                    changed = true;
+                }
+            }
+            if(changed)
+                worklist.push_back(s);
+        }
+    }
+
+    // Captured by children as upvalue while holding the closure
+    for(std::size_t i = 0; i < function->childCount(); ++i) {
+        auto child = function->getChild(i);
+        for(int j = 0; j < child->upvalueCount(); ++j) {
+            auto info = child->getUpvalueInfo(j);
+            if(!info->isParentLocal)
+                continue;
+            for(int k = 0; k < n; ++k)
+                if(info->registerIndex < top && states[k][info->registerIndex])
+                    return true;
+        }
+    }
+
+    return false;
+}
+
+void analyzeEscapes(Function *function)
+{
+    // Registers of the main function outlive its frame in the interactive
+    // loop, so its closures always live in the heap
+    if(!function->getParent())
+        return;
+
+    for(std::size_t pc = 0; pc < function->codeSize(); ++pc) {
+        auto code = function->getCode(pc);
+        if(code->op != Code::Closure || escapes(function, pc))
+            continue;
+
+        // Closure, upvalue pointers and upvalues stored together
+        int n = function->getChild(code->arg1)->upvalueCount();
+        int size = Closure::allocationSize(n) + n * sizeof(Upvalue);
+        size = (size + 15) & ~15;
+        code->op = Code::ClosureLocal;
+        code->arg2 = function->reserveFrameStorage(size);
+    }
+}
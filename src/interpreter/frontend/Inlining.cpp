@@ -0,0 +1,329 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Optimizer.h"
+#include "Function.h"
+#include <vector>
+
+class Inliner {
+public:
+    Inliner(Function *function):function(function), growth(0) {
+        budget = function->codeSize();
+        if(budget < INLINE_GROWTH_LIMIT)
+            budget = INLINE_GROWTH_LIMIT;
+    }
+
+    void run() {
+        // Each inlined call may expose calls of the callee to further
+        // inlining, so scan again until nothing changes
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            analyze();
+            int n = function->codeSize();
+            for(int pc = 0; pc < n && !changed; ++pc)
+                changed = tryInline(pc);
+        }
+    }
+
+private:
+    void analyze() {
+        int n = function->codeSize();
+        top = function->slotCount();
+        targets.assign(n + 1, false);
+        for(int i = 0; i < n; ++i) {
+            auto c = function->getCode(i);
+            if(c->isJump() && c->result >= 0 && c->result <= n)
+                targets[c->result] = true;
+        }
+    }
+
+    // Index of the only code writing register reg, -1 if there are more
+    int soleDefinition(int reg) {
+        int n = function->codeSize();
+        int def = -1;
+        std::vector<int> defs;
+        for(int i = 0; i < n; ++i) {
+            defs.clear();
+            function->getCode(i)->getDefs(defs, top);
+            for(auto r : defs) {
+                if(r != reg)
+                    continue;
+                if(def != -1)
+                    return -1;
+                def = i;
+            }
+        }
+        return def;
+    }
+
+    // Whether every path from the entry to code at pc passes the code at def
+    bool dominates(int def, int pc) {
+        int n = function->codeSize();
+        // in[i]: def was executed on every path reaching i
+        std::vector<bool> in(n + 1, true);
+        in[0] = false;
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            std::vector<bool> next(n + 1, true);
+            next[0] = false;
+            for(int i = 0; i < n; ++i) {
+                auto c = function->getCode(i);
+                bool out = in[i] || i == def;
+                if(c->fallsThrough() && !out)
+                    next[i + 1] = false;
+                if(c->isJump() && !out && c->result >= 0 && c->result <= n)
+                    next[c->result] = false;
+            }
+            if(next != in) {
+                in = next;
+                changed = true;
+            }
+        }
+        return in[pc];
+    }
+
+    // Prototype called by the Call at pc when it is known at compile time:
+    // the closure register was loaded in the same basic block, either by
+    // a Closure or by a move from a local bound once to a Closure.
+    // The register of that local is stored to local, -1 if there is none.
+    Function *staticCallee(int pc, int &local) {
+        int reg = function->getCode(pc)->arg1;
+        local = -1;
+
+        std::vector<int> defs;
+        int def = -1;
+        for(int i = pc - 1; i >= 0 && def == -1; --i) {
+            if(targets[i + 1])
+                return nullptr;
+            defs.clear();
+            function->getCode(i)->getDefs(defs, top);
+            for(auto r : defs)
+                if(r == reg)
+                    def = i;
+        }
+        if(def == -1)
+            return nullptr;
+
+        auto c = function->getCode(def);
+        if(c->op == Code::Closure)
+            return function->getChild(c->arg1);
+        if(c->op != Code::Move || c->arg1 < 0)
+            return nullptr;
+
+        local = c->arg1;
+        int bind = soleDefinition(local);
+        if(bind == -1 || function->getCode(bind)->op != Code::Closure)
+            return nullptr;
+        if(writesCaptured(function, local) || !dominates(bind, def))
+            return nullptr;
+        return function->getChild(function->getCode(bind)->arg1);
+    }
+
+    bool inlinable(Function *callee, int nargs, int local) {
+        if(callee->isDeferred() || callee->childCount() != 0 || callee->paramCount() != nargs)
+            return false;
+        int n = callee->codeSize();
+        if(n > INLINE_SIZE_LIMIT || growth + n > budget)
+            return false;
+
+        // Calling itself through the local it is bound to
+        for(int i = 0; i < callee->upvalueCount(); ++i) {
+            auto info = callee->getUpvalueInfo(i);
+            if(info->isParentLocal && info->registerIndex == local)
+                return false;
+        }
+
+        for(int i = 0; i < n; ++i) {
+            auto c = callee->getCode(i);
+            if(c->op == Code::Return && c->arg2 == -1)
+                return false;
+        }
+        return true;
+    }
+
+    // Map an RK operand of callee into this function
+    int mapRK(Function *callee, int base, int rk) {
+        if(rk >= 0)
+            return base + rk;
+        return -(int)function->addConstant(callee->getConstant(-rk));
+    }
+
+    bool tryInline(int pc) {
+        // Calls passing on all their results, like return f(x), take the
+        // values up to the top, which the inlined codes would raise
+        auto call = *function->getCode(pc);
+        if(call.op != Code::Call || call.arg2 < 0 || call.result == -1)
+            return false;
+
+        int local;
+        auto callee = staticCallee(pc, local);
+        if(!callee || callee == function || !inlinable(callee, call.arg2, local))
+            return false;
+
+        // Callee registers are placed where the call would put its frame
+        int base = call.arg1 + 1;
+        int nresults = call.result;
+        int n = callee->codeSize();
+
+        // Index of each callee code inside the inlined sequence
+        std::vector<int> start(n + 1);
+        int length = 0;
+        for(int i = 0; i < n; ++i) {
+            start[i] = length;
+            auto c = callee->getCode(i);
+            if(c->op != Code::Return) {
+                ++length;
+                continue;
+            }
+            int nvalues = c->arg2;
+            length += nvalues < nresults ? nvalues : nresults;
+            if(nvalues < nresults)
+                ++length;
+            if(i != n - 1)
+                ++length;
+        }
+        start[n] = length;
+
+        std::vector<Code> codes;
+        std::vector<int> lines;
+        for(int i = 0; i < n; ++i) {
+            auto c = *callee->getCode(i);
+            int line = callee->getLine(i);
+            switch(c.op) {
+            case Code::Add:
+            case Code::Sub:
+            case Code::Mul:
+            case Code::Div:
+            case Code::Pow:
+            case Code::Mod:
+            case Code::Lt:
+            case Code::Le:
+            case Code::Gt:
+            case Code::Ge:
+            case Code::Eq:
+            case Code::Ne:
+            case Code::GetIndex:
+                c.arg1 = mapRK(callee, base, c.arg1);
+                c.arg2 = mapRK(callee, base, c.arg2);
+                c.result += base;
+                break;
+            case Code::Minus:
+            case Code::Move:
+                c.arg1 = mapRK(callee, base, c.arg1);
+                c.result += base;
+                break;
+            case Code::Jmp:
+                c.result = pc + start[c.result];
+                break;
+            case Code::Jnz:
+                c.arg1 = mapRK(callee, base, c.arg1);
+                c.result = pc + start[c.result];
+                break;
+            case Code::Jlt:
+            case Code::Jle:
+            case Code::Jgt:
+            case Code::Jge:
+            case Code::Jeq:
+            case Code::Jne:
+                c.arg1 = mapRK(callee, base, c.arg1);
+                c.arg2 = mapRK(callee, base, c.arg2);
+                c.result = pc + start[c.result];
+                break;
+            case Code::ForPrep:
+            case Code::ForLoop:
+            case Code::ForPrepInt:
+            case Code::ForLoopInt:
+                c.arg1 += base;
+                c.result = pc + start[c.result];
+                break;
+            case Code::SetIndex:
+                c.arg1 += base;
+                c.arg2 = mapRK(callee, base, c.arg2);
+                c.result = mapRK(callee, base, c.result);
+                break;
+            case Code::NewArray:
+                c.arg1 += base;
+                c.result += base;
+                break;
+            case Code::Call:
+            case Code::Nil:
+                c.arg1 += base;
+                break;
+            case Code::Bool:
+                c.result += base;
+                break;
+            case Code::GetUpval: {
+                // The closure was created by this frame, its upvalues are
+                // the locals and upvalues of this function
+                auto info = callee->getUpvalueInfo(c.arg1);
+                if(info->isParentLocal)
+                    c = Code(Code::Move, info->registerIndex, 0, base + c.result);
+                else
+                    c = Code(Code::GetUpval, info->registerIndex, 0, base + c.result);
+                break;
+            }
+            case Code::SetUpval: {
+                auto info = callee->getUpvalueInfo(c.result);
+                int value = mapRK(callee, base, c.arg1);
+                if(info->isParentLocal)
+                    c = Code(Code::Move, value, 0, info->registerIndex);
+                else
+                    c = Code(Code::SetUpval, value, 0, info->registerIndex);
+                break;
+            }
+            case Code::Return: {
+                // Results go where the call would leave them, copying
+                // upward is safe since the values live above them
+                int nvalues = c.arg2 < nresults ? c.arg2 : nresults;
+                for(int k = 0; k < nvalues; ++k) {
+                    codes.push_back(Code(Code::Move, base + c.arg1 + k, 0, call.arg1 + k));
+                    lines.push_back(line);
+                }
+                if(nvalues < nresults) {
+                    codes.push_back(Code(Code::Nil, call.arg1 + nvalues, nresults - nvalues, 0));
+                    lines.push_back(line);
+                }
+                if(i != n - 1) {
+                    codes.push_back(Code(Code::Jmp, 0, 0, pc + start[n]));
+                    lines.push_back(line);
+                }
+                continue;
+            }
+            default:
+                break;
+            }
+            codes.push_back(c);
+            lines.push_back(line);
+        }
+
+        function->replaceCode(pc, codes, lines);
+        growth += codes.size() - 1;
+        return true;
+    }
+
+    Function *function;
+    int top;
+    // Codes which are targets of jumps, indexed by code
+    std::vector<bool> targets;
+    int growth;
+    int budget;
+};
+
+void inlineCalls(Function *function)
+{
+    Inliner(function).run();
+}
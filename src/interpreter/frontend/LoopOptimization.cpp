@@ -0,0 +1,499 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Optimizer.h"
+#include "Function.h"
+#include <vector>
+#include <map>
+#include <algorithm>
+
+using std::vector;
+
+// A loop as generated by iteration_statement.
+//
+// for:   prep: FORPREP A -> latch
+//        head = body ... latch: FORLOOP A -> body
+// while: head ... (condition jumping to body or to latch+1)
+//        body ... latch: JMP -> head
+struct Loop {
+    bool isFor;
+    int prep;
+    int head;
+    int body;
+    int latch;
+};
+
+// Loop-invariant code motion and strength reduction of one function.
+//
+// Invariant codes of a loop body move into a preheader which is only run
+// once the first test of the loop passed, so a loop running zero times
+// evaluates nothing more than before. A for loop gets the test of its
+// FORLOOP in front of the preheader, a while loop is rotated so that the
+// back edge runs a copy of the condition and enters the body behind the
+// preheader.
+class LoopOptimizer {
+public:
+    LoopOptimizer(Function *function):function(function) {
+    }
+
+    void run() {
+        findLoops();
+        // Inner loops first, their preheaders are then part of the
+        // outer loops and may move out further
+        std::sort(loops.begin(), loops.end(), [](const Loop &a, const Loop &b) {
+            return a.latch - a.head < b.latch - b.head;
+        });
+        for(std::size_t k = 0; k < loops.size(); ++k) {
+            analyze();
+            optimizeLoop(k);
+        }
+    }
+
+    // Integer counters stepped by an integer constant count their trips
+    // instead of comparing against the range in every iteration
+    void specialize() {
+        analyze();
+        int n = function->codeSize();
+        vector<int> defs;
+        for(int p = 0; p < n; ++p) {
+            auto prep = function->getCode(p);
+            if(prep->op != Code::ForPrep)
+                continue;
+            int base = prep->arg1;
+            int latch = prep->result;
+            int start, step, end;
+            if(integerLoad(p, base, start) == -1 || integerLoad(p, base + 2, step) == -1 || step == 0)
+                continue;
+
+            // The counter may only be stepped by the loop itself
+            bool written = captured[base + 3];
+            for(int i = p + 1; i < latch && !written; ++i) {
+                defs.clear();
+                function->getCode(i)->getDefs(defs, top);
+                for(auto r : defs)
+                    written = written || (r >= base + 1 && r <= base + 3);
+            }
+            if(written)
+                continue;
+
+            // Constant ranges get their trip count at compile time
+            int counted = 0;
+            int load = integerLoad(p, base + 1, end);
+            if(load != -1) {
+                int count = Code::tripCount(start, end, step);
+                *function->getCode(load) = Code(Code::Move, -(int)function->addConstant(Operand(count)), 0, base + 1);
+                counted = 1;
+            }
+            *prep = Code(Code::ForPrepInt, base, counted, latch);
+            auto loop = function->getCode(latch);
+            *loop = Code(Code::ForLoopInt, base, 0, loop->result);
+        }
+    }
+
+private:
+    void findLoops() {
+        int n = function->codeSize();
+        for(int j = 0; j < n; ++j) {
+            auto c = function->getCode(j);
+            if(!c->isJump() || c->result > j)
+                continue;
+            int h = c->result;
+            if(c->op == Code::ForLoop || c->op == Code::ForLoopInt) {
+                auto prep = h > 0 ? function->getCode(h - 1) : nullptr;
+                if(prep && (prep->op == Code::ForPrep || prep->op == Code::ForPrepInt)
+                        && prep->arg1 == c->arg1 && prep->result == j)
+                    loops.push_back(Loop{true, h - 1, h, h, j});
+            } else if(c->op == Code::Jmp) {
+                int body = conditionEnd(h, j);
+                if(body != -1)
+                    loops.push_back(Loop{false, -1, h, body, j});
+            }
+        }
+    }
+
+    // End of the condition of a while loop from head to latch, -1 if the
+    // code does not have the expected shape. The condition ends with a
+    // jump leaving the loop and its jumps stay inside it or leave the loop.
+    int conditionEnd(int head, int latch) {
+        int exit = latch + 1;
+        for(int k = head + 1; k <= latch; ++k) {
+            auto last = function->getCode(k - 1);
+            if(last->op != Code::Jmp || last->result != exit)
+                continue;
+
+            bool ok = true;
+            int n = function->codeSize();
+            for(int i = 0; i < n && ok; ++i) {
+                auto c = function->getCode(i);
+                if(!c->isJump() || i == latch)
+                    continue;
+                int t = c->result;
+                if(i >= head && i < k)
+                    ok = t == exit || (t >= head && t <= k);
+                else if(i >= k && i < latch)
+                    ok = t >= k && t <= exit;
+                else
+                    ok = t <= head || t > latch;
+            }
+            return ok ? k : -1;
+        }
+        return -1;
+    }
+
+    // Jump targets, captured registers and liveness of registers
+    void analyze() {
+        int n = function->codeSize();
+        top = function->slotCount();
+
+        findCaptured(function, captured);
+
+        targets.assign(n + 1, false);
+        for(int pc = 0; pc < n; ++pc) {
+            auto c = function->getCode(pc);
+            if(c->isJump() && c->result >= 0 && c->result <= n)
+                targets[c->result] = true;
+        }
+
+        liveIn.assign(n + 1, vector<bool>(top, false));
+        bool changed = true;
+        vector<int> regs;
+        while(changed) {
+            changed = false;
+            for(int pc = n - 1; pc >= 0; --pc) {
+                auto c = function->getCode(pc);
+                vector<bool> live(top, false);
+                if(c->fallsThrough())
+                    live = liveIn[pc + 1];
+                if(c->isJump() && c->result >= 0 && c->result <= n)
+                    for(int r = 0; r < top; ++r)
+                        live[r] = live[r] || liveIn[c->result][r];
+                regs.clear();
+                c->getDefs(regs, top);
+                for(auto r : regs)
+                    live[r] = false;
+                regs.clear();
+                c->getUses(regs, top);
+                for(auto r : regs)
+                    live[r] = true;
+                if(live != liveIn[pc]) {
+                    liveIn[pc].swap(live);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Whether every path from the start of the body to the latch passes pc.
+    // A Return leaves the loop like the latch, codes after it may not run.
+    bool dominatesLatch(const Loop &loop, int pc) {
+        int first = loop.body;
+        int count = loop.latch - first + 1;
+        // reached[i]: code first+i is reachable without passing pc
+        vector<bool> reached(count, false);
+        reached[0] = first != pc;
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            for(int i = 0; i < count; ++i) {
+                if(!reached[i] || first + i == pc)
+                    continue;
+                auto c = function->getCode(first + i);
+                int next[2] = {-1, -1};
+                if(c->op == Code::Return)
+                    next[0] = count - 1;
+                if(c->fallsThrough())
+                    next[0] = i + 1;
+                if(c->isJump())
+                    next[1] = c->result - first;
+                for(auto s : next) {
+                    if(s >= 0 && s < count && !reached[s]) {
+                        reached[s] = true;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        return !reached[count - 1];
+    }
+
+    // Index of the code loading an integer constant, or its negation, into
+    // register reg right before pc in the same basic block, -1 if none
+    int integerLoad(int pc, int reg, int &value) {
+        vector<int> defs;
+        for(int i = pc - 1; i >= 0; --i) {
+            if(targets[i + 1])
+                return -1;
+            defs.clear();
+            auto c = function->getCode(i);
+            c->getDefs(defs, top);
+            if(std::find(defs.begin(), defs.end(), reg) == defs.end())
+                continue;
+            if((c->op != Code::Move && c->op != Code::Minus) || c->arg1 >= 0)
+                return -1;
+            auto &k = function->getConstant(-c->arg1);
+            if(k.type != Operand::IntegerType)
+                return -1;
+            value = c->op == Code::Minus ? -k.integer : k.integer;
+            return i;
+        }
+        return -1;
+    }
+
+    // Replace code i, keeping the positions of recorded loops up to date
+    void replace(int i, const vector<Code> &codes, const vector<int> &lines) {
+        function->replaceCode(i, codes, lines);
+        int shift = (int)codes.size() - 1;
+        for(auto &l : loops) {
+            int *positions[] = {&l.prep, &l.head, &l.body, &l.latch};
+            for(auto p : positions)
+                if(*p > i)
+                    *p += shift;
+        }
+    }
+
+    void optimizeLoop(std::size_t k) {
+        Loop loop = loops[k];
+        int exit = loop.latch + 1;
+
+        // Definitions inside the loop
+        vector<int> defCount(top, 0);
+        vector<bool> setUpvals(function->upvalueCount(), false);
+        bool hasCall = false;
+        int minCallBase = top;
+        vector<int> regs;
+        for(int i = loop.head; i <= loop.latch; ++i) {
+            auto c = function->getCode(i);
+            regs.clear();
+            c->getDefs(regs, top);
+            for(auto r : regs)
+                ++defCount[r];
+            if(c->op == Code::SetUpval)
+                setUpvals[c->result] = true;
+            if(c->op == Code::Call) {
+                hasCall = true;
+                minCallBase = std::min(minCallBase, c->arg1);
+            }
+        }
+        // Callees may assign captured locals
+        if(hasCall)
+            for(int r = 0; r < top; ++r)
+                if(captured[r])
+                    defCount[r] += 2;
+
+        // Loop counter and the integer constants it starts and steps by.
+        // Only the latch may write the counter, like in specialize().
+        int counter = -1, start = 0, step = 0;
+        if(loop.isFor) {
+            int base = function->getCode(loop.prep)->arg1;
+            if(integerLoad(loop.prep, base, start) != -1 && integerLoad(loop.prep, base + 2, step) != -1
+                    && defCount[base + 3] == 1 && !captured[base + 3])
+                counter = base + 3;
+        }
+
+        // Name of a register in the preheader, -1 if it varies in the loop
+        std::map<int, int> hoisted;
+        auto invariant = [&](int rk) {
+            if(rk < 0 || defCount[rk] == 0)
+                return rk;
+            auto it = hoisted.find(rk);
+            return it != hoisted.end() ? it->second : -1;
+        };
+        auto invariantOperands = [&](Code &c) {
+            if(c.op != Code::Minus && c.op != Code::Move) {
+                int b = invariant(c.arg2);
+                if(b == -1 && c.arg2 >= 0)
+                    return false;
+                c.arg2 = b == -1 ? c.arg2 : b;
+            }
+            int a = invariant(c.arg1);
+            if(a == -1 && c.arg1 >= 0)
+                return false;
+            c.arg1 = a == -1 ? c.arg1 : a;
+            return true;
+        };
+
+        // Register kept in the preheader for the whole loop instead of
+        // being written by its only definition in the body
+        auto movable = [&](int r) {
+            return defCount[r] == 1 && !liveIn[loop.head][r] && !liveIn[exit][r]
+                   && !captured[r] && (!hasCall || r < minCallBase);
+        };
+
+        int fresh = top;
+        vector<Code> preheader;
+        vector<int> preheaderLines;
+        vector<Code> latchCodes;
+        // Rewritten body codes, an empty list removes the code
+        std::map<int, vector<Code>> rewrites;
+
+        for(int i = loop.body; i < loop.latch; ++i) {
+            Code c = *function->getCode(i);
+            int r = c.result;
+            switch(c.op) {
+            case Code::Add:
+            case Code::Sub:
+            case Code::Mul:
+            case Code::Div:
+            case Code::Pow:
+            case Code::Mod:
+            case Code::Lt:
+            case Code::Le:
+            case Code::Gt:
+            case Code::Ge:
+            case Code::Eq:
+            case Code::Ne:
+            case Code::Minus: {
+                // i*k with integer counter and factor: r steps by step*k
+                if(c.op == Code::Mul && counter != -1 && movable(r)) {
+                    int factor = c.arg1 == counter ? c.arg2 : c.arg2 == counter ? c.arg1 : 0;
+                    if(factor < 0 && function->getConstant(-factor).type == Operand::IntegerType) {
+                        int value = function->getConstant(-factor).integer;
+                        int first = function->addConstant(Operand(start * value));
+                        int increment = function->addConstant(Operand(step * value));
+                        preheader.push_back(Code(Code::Move, -first, 0, r));
+                        preheaderLines.push_back(function->getLine(i));
+                        latchCodes.push_back(Code(Code::Add, r, -increment, r));
+                        rewrites[i] = vector<Code>();
+                        break;
+                    }
+                }
+                // Arithmetic and comparisons may fail on operand types,
+                // only move codes which run in every iteration anyway
+                if(!invariantOperands(c) || !dominatesLatch(loop, i))
+                    break;
+                if(movable(r)) {
+                    hoisted[r] = r;
+                    rewrites[i] = vector<Code>();
+                } else if(!hasCall) {
+                    // Keep the value in a new register, the body copies it
+                    c.result = fresh++;
+                    if(defCount[r] == 1 && !liveIn[loop.head][r])
+                        hoisted[r] = c.result;
+                    rewrites[i] = vector<Code>(1, Code(Code::Move, c.result, 0, r));
+                } else {
+                    break;
+                }
+                preheader.push_back(c);
+                preheaderLines.push_back(function->getLine(i));
+                break;
+            }
+            case Code::Move:
+            case Code::GetUpval:
+                if(c.op == Code::GetUpval && (hasCall || setUpvals[c.arg1]))
+                    break;
+                if(c.op == Code::Move && !invariantOperands(c))
+                    break;
+                if(!movable(r))
+                    break;
+                hoisted[r] = r;
+                rewrites[i] = vector<Code>();
+                preheader.push_back(c);
+                preheaderLines.push_back(function->getLine(i));
+                break;
+            default:
+                break;
+            }
+        }
+
+        if(preheader.empty())
+            return;
+
+        // Rewrite the body from the back, so earlier positions stay valid
+        for(auto it = rewrites.rbegin(); it != rewrites.rend(); ++it)
+            replace(it->first, it->second, vector<int>(it->second.size(), function->getLine(it->first)));
+        loop = loops[k];
+
+        int line = function->getLine(loop.latch);
+        if(!latchCodes.empty()) {
+            Code back = *function->getCode(loop.latch);
+            latchCodes.push_back(back);
+            replace(loop.latch, latchCodes, vector<int>(latchCodes.size(), line));
+            loops[k].latch += latchCodes.size() - 1;
+            loop = loops[k];
+        }
+
+        if(loop.isFor) {
+            // FORPREP falls into the first test, which skips the loop or
+            // enters the preheader
+            int p = loop.prep;
+            Code prep = *function->getCode(p);
+            Code test = *function->getCode(loop.latch);
+            int length = 3 + preheader.size();
+            int end = loop.latch + 1 + length - 1;
+            vector<Code> codes;
+            codes.push_back(Code(prep.op, prep.arg1, prep.arg2, p + 1));
+            codes.push_back(Code(test.op, test.arg1, 0, p + 3));
+            codes.push_back(Code(Code::Jmp, 0, 0, end));
+            codes.insert(codes.end(), preheader.begin(), preheader.end());
+            vector<int> lines(3, function->getLine(p));
+            lines.insert(lines.end(), preheaderLines.begin(), preheaderLines.end());
+            replace(p, codes, lines);
+        } else {
+            // The condition jumps to the preheader in front of the body
+            // replace() only retargets the other codes, the first one, like
+            // the jump of an if starting the body, moves past the preheader
+            Code first = *function->getCode(loop.body);
+            if(first.isJump() && first.result > loop.body)
+                first.result += preheader.size();
+            preheader.push_back(first);
+            preheaderLines.push_back(function->getLine(loop.body));
+            replace(loop.body, preheader, preheaderLines);
+            int body = loop.body + preheader.size() - 1;
+            loop = loops[k];
+
+            // The back edge runs a copy of the condition
+            int head = loop.head;
+            int length = loop.body - head;
+            int at = loop.latch;
+            int end = at + 1 + length - 1;
+            vector<Code> codes;
+            vector<int> lines;
+            for(int i = head; i < head + length; ++i) {
+                Code c = *function->getCode(i);
+                if(c.isJump()) {
+                    if(c.result == loop.body)
+                        c.result = body;
+                    else if(c.result == at + 1)
+                        c.result = end;
+                    else
+                        c.result = at + (c.result - head);
+                }
+                codes.push_back(c);
+                lines.push_back(function->getLine(i));
+            }
+            replace(at, codes, lines);
+        }
+    }
+
+    Function *function;
+    vector<Loop> loops;
+    int top;
+    // Registers captured by children
+    vector<bool> captured;
+    // Codes which are targets of jumps, indexed by code
+    vector<bool> targets;
+    // Registers live at the start of each code
+    vector<vector<bool>> liveIn;
+};
+
+void optimizeLoops(Function *function)
+{
+    LoopOptimizer(function).run();
+}
+
+void specializeForLoops(Function *function)
+{
+    LoopOptimizer(function).specialize();
+}
@@ -0,0 +1,141 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Number.h"
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+
+int scanInteger(const char *text, int length)
+{
+    std::int64_t value = 0;
+    for(int i = 0; i < length; ++i) {
+        value = value * 10 + (text[i] - '0');
+        if(value > INT_MAX)
+            return INT_MAX;
+    }
+    return static_cast<int>(value);
+}
+
+// Powers of ten which are exact doubles
+static const double exactPowers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Largest integer below which all integers are exact doubles
+#define EXACT_INTEGER_LIMIT (UINT64_C(1) << 53)
+
+double scanReal(const char *text, int length)
+{
+    // Significant digits, without leading zeros and the point
+    char digits[REAL_DIGITS + 1];
+    int ndigits = 0;
+    // Digits of the mantissa while it fits
+    std::uint64_t mantissa = 0;
+    // Decimal exponent of the last digit kept
+    int exponent = 0;
+    bool dropped = false;
+
+    int i = 0;
+    bool fraction = false;
+    for(; i < length; ++i) {
+        char c = text[i];
+        if(c == '.') {
+            fraction = true;
+            continue;
+        }
+        if(c < '0' || c > '9')
+            break;
+        if(ndigits == 0 && c == '0') {
+            if(fraction)
+                --exponent;
+            continue;
+        }
+        if(ndigits < REAL_DIGITS) {
+            digits[ndigits++] = c;
+            if(ndigits <= 19)
+                mantissa = mantissa * 10 + (c - '0');
+            if(fraction)
+                --exponent;
+        } else {
+            dropped = dropped || c != '0';
+            if(!fraction)
+                ++exponent;
+        }
+    }
+
+    if(i < length && (text[i] == 'e' || text[i] == 'E')) {
+        ++i;
+        bool negative = false;
+        if(i < length && (text[i] == '+' || text[i] == '-'))
+            negative = text[i++] == '-';
+        int e = 0;
+        for(; i < length && text[i] >= '0' && text[i] <= '9'; ++i)
+            if(e < 100000)
+                e = e * 10 + (text[i] - '0');
+        exponent += negative ? -e : e;
+    }
+
+    if(ndigits == 0)
+        return 0;
+
+    // Both the mantissa and the power of ten are exact, so is the rounded
+    // product or quotient
+    if(ndigits <= 19 && mantissa <= EXACT_INTEGER_LIMIT) {
+        if(exponent >= 0 && exponent <= 22)
+            return mantissa * exactPowers[exponent];
+        if(exponent < 0 && exponent >= -22)
+            return mantissa / exactPowers[-exponent];
+        // Move part of a large exponent into the mantissa while it stays exact
+        if(exponent > 22 && exponent <= 22 + 15) {
+            std::uint64_t m = mantissa;
+            int e = exponent;
+            while(e > 22 && m <= EXACT_INTEGER_LIMIT / 10) {
+                m *= 10;
+                --e;
+            }
+            if(e == 22)
+                return m * exactPowers[22];
+        }
+    }
+
+    // Otherwise let strtod round an integer mantissa with an exponent,
+    // which has no decimal point to depend on the locale. A nonzero digit
+    // stands for the digits dropped, so that ties are broken upward.
+    char buffer[REAL_DIGITS + 16];
+    int n = 0;
+    for(int k = 0; k < ndigits; ++k)
+        buffer[n++] = digits[k];
+    if(dropped) {
+        buffer[n++] = '1';
+        --exponent;
+    }
+    buffer[n++] = 'e';
+    if(exponent < 0) {
+        buffer[n++] = '-';
+        exponent = -exponent;
+    }
+    char reversed[8];
+    int r = 0;
+    do {
+        reversed[r++] = '0' + exponent % 10;
+        exponent /= 10;
+    } while(exponent);
+    while(r)
+        buffer[n++] = reversed[--r];
+    buffer[n] = '\0';
+    return std::strtod(buffer, nullptr);
+}
@@ -0,0 +1,34 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef NUMBER_H
+#define NUMBER_H
+
+// Conversion of the numeric literals matched by the lexer. Both functions
+// read exactly length characters, which need not end with a NUL, do not
+// allocate and do not depend on the locale.
+
+// Significant digits of real literals taken into account
+#define REAL_DIGITS 100
+
+// Value of the decimal digits text, INT_MAX if it is larger
+int scanInteger(const char *text, int length);
+
+// Value of the real literal text: digits with an optional fraction and
+// exponent. The result is correctly rounded for literals of at most
+// REAL_DIGITS significant digits.
+double scanReal(const char *text, int length);
+
+#endif /* NUMBER_H */
@@ -0,0 +1,102 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Optimizer.h"
+#include "Function.h"
+
+// Compile-time passes of function and its children
+static void transform(Function *function)
+{
+    // Children first, so callees are inlined in their optimized form
+    for(std::size_t i = 0; i < function->childCount(); ++i)
+        transform(function->getChild(i));
+
+    if(!function->isOptimized()) {
+        inlineCalls(function);
+        eliminateCommonSubexpressions(function);
+        specializeForLoops(function);
+        optimizeLoops(function);
+        analyzeEscapes(function);
+        allocateRegisters(function);
+    }
+}
+
+// Typed codes and superinstructions are created last, once no function
+// is inlined anymore
+static void lower(Function *function)
+{
+    for(std::size_t i = 0; i < function->childCount(); ++i)
+        lower(function->getChild(i));
+
+    if(!function->isOptimized()) {
+        inferTypes(function);
+        fuseInstructions(function);
+        function->setOptimized();
+    }
+}
+
+void optimize(Function *function)
+{
+    transform(function);
+    lower(function);
+    analyzePurity(function);
+}
+
+bool writesUpvalue(Function *function, int index)
+{
+    int n = function->codeSize();
+    for(int i = 0; i < n; ++i) {
+        auto c = function->getCode(i);
+        if(c->op == Code::SetUpval && c->result == index)
+            return true;
+    }
+
+    for(std::size_t i = 0; i < function->childCount(); ++i) {
+        auto child = function->getChild(i);
+        for(int j = 0; j < child->upvalueCount(); ++j) {
+            auto info = child->getUpvalueInfo(j);
+            if(!info->isParentLocal && info->registerIndex == index && writesUpvalue(child, j))
+                return true;
+        }
+    }
+    return false;
+}
+
+bool writesCaptured(Function *function, int reg)
+{
+    for(std::size_t i = 0; i < function->childCount(); ++i) {
+        auto child = function->getChild(i);
+        for(int j = 0; j < child->upvalueCount(); ++j) {
+            auto info = child->getUpvalueInfo(j);
+            if(info->isParentLocal && info->registerIndex == reg && writesUpvalue(child, j))
+                return true;
+        }
+    }
+    return false;
+}
+
+void findCaptured(Function *function, std::vector<bool> &captured)
+{
+    int top = function->slotCount();
+    captured.assign(top, false);
+    for(std::size_t i = 0; i < function->childCount(); ++i) {
+        auto child = function->getChild(i);
+        for(int j = 0; j < child->upvalueCount(); ++j) {
+            auto info = child->getUpvalueInfo(j);
+            if(info->isParentLocal && info->registerIndex < top)
+                captured[info->registerIndex] = true;
+        }
+    }
+}
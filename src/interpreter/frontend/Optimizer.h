@@ -0,0 +1,81 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// 
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <vector>
+
+class Function;
+
+// Callees longer than this are never inlined
+#define INLINE_SIZE_LIMIT 24
+// Codes inlining may add to a function, or its own size if larger
+#define INLINE_GROWTH_LIMIT 256
+
+// Run compile-time passes on function and its children after parsing.
+// Functions already optimized are skipped, so it is safe to call again
+// after new code is parsed into the main function.
+void optimize(Function *function);
+
+// Inlining: calls of small child functions known at compile time are
+// replaced by the code of the callee
+void inlineCalls(Function *function);
+
+// Common subexpression elimination: codes of a basic block recomputing
+// a value some register still holds become moves from it, copies are read
+// from the original register and moves nobody reads are removed
+void eliminateCommonSubexpressions(Function *function);
+
+// For loop specialization: integer counters with an integer constant step
+// use FORPREPINT/FORLOOPINT, which count the trips of the loop
+void specializeForLoops(Function *function);
+
+// Loop optimization: invariant codes of loops move in front of them and
+// multiplications of an integer loop counter become additions
+void optimizeLoops(Function *function);
+
+// Escape analysis: closures which never leave the frame creating them are
+// rewritten to ClosureLocal and allocated in the frame storage
+void analyzeEscapes(Function *function);
+
+// Register allocation: renumber temporaries by liveness so the function
+// needs as few registers as possible
+void allocateRegisters(Function *function);
+
+// Type inference: arithmetic and comparisons whose operand types are
+// proven at compile time use typed codes without runtime type checks
+void inferTypes(Function *function);
+
+// Peephole fusion: frequent code pairs become superinstructions. Other
+// passes do not know them, so it runs after all of them on every function.
+void fuseInstructions(Function *function);
+
+// Purity analysis: functions whose result only depends on their arguments
+// are marked pure, the VM memoizes their calls with numeric arguments
+void analyzePurity(Function *function);
+
+// Whether the upvalue index of function, or of its descendants sharing it,
+// is assigned by SetUpval
+bool writesUpvalue(Function *function, int index);
+
+// Whether local register reg of function is assigned through an upvalue
+bool writesCaptured(Function *function, int reg);
+
+// Mark the registers of function which children capture as upvalues, and
+// so may assign behind calls, one flag per slot
+void findCaptured(Function *function, std::vector<bool> &captured);
+
+#endif /* OPTIMIZER_H */
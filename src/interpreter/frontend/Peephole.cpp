@@ -0,0 +1,76 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Optimizer.h"
+#include "Function.h"
+#include <vector>
+
+// Superinstruction replacing first and the following second at pc,
+// Nop if they cannot be fused
+static Code fuse(const Code &first, const Code &second, int pc)
+{
+    auto op = Code::fused(first.op, second.op);
+    switch(op) {
+    case Code::Move2:
+        if(second.result != first.result + 1)
+            return Code();
+        return Code(op, first.arg1, second.arg1, first.result);
+    case Code::Nop:
+        return Code();
+    default:
+        if(first.op == Code::Move) {
+            // MOVE x t; ADD t y t is ADD x y t, t is overwritten anyway
+            if(second.result != first.result)
+                return Code();
+            if(second.arg1 != first.result && second.arg2 != first.result)
+                return Code();
+            Code code = second;
+            if(code.arg1 == first.result)
+                code.arg1 = first.arg1;
+            if(code.arg2 == first.result)
+                code.arg2 = first.arg1;
+            return code;
+        }
+        // Conditional jump over the Jmp: jump where the Jmp goes unless
+        // the condition holds
+        if(first.result != pc + 2)
+            return Code();
+        return Code(op, first.arg1, first.arg2, second.result);
+    }
+}
+
+void fuseInstructions(Function *function)
+{
+    int n = function->codeSize();
+    std::vector<bool> targets(n + 1, false);
+    for(int i = 0; i < n; ++i) {
+        auto c = function->getCode(i);
+        if(c->isJump() && c->result >= 0 && c->result <= n)
+            targets[c->result] = true;
+    }
+
+    // The second code of a pair must not be entered by a jump
+    for(int pc = 0; pc + 1 < (int)function->codeSize(); ++pc) {
+        if(targets[pc + 1])
+            continue;
+        auto code = fuse(*function->getCode(pc), *function->getCode(pc + 1), pc);
+        if(code.op == Code::Nop)
+            continue;
+        function->replaceCode(pc, std::vector<Code>(1, code), std::vector<int>(1, function->getLine(pc)));
+        function->replaceCode(pc + 1, std::vector<Code>(), std::vector<int>());
+        targets.erase(targets.begin() + pc + 1);
+    }
+}
@@ -0,0 +1,128 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Optimizer.h"
+#include "Function.h"
+#include <vector>
+#include <unordered_map>
+
+// Pure functions create no closures, assign no upvalues and read only
+// upvalues bound once to a closure of a pure function. Their arguments are
+// checked to be numbers when called, so any closure they may call is
+// either a builtin or reached through these upvalues.
+class PurityAnalysis {
+public:
+    PurityAnalysis(Function *function) {
+        collect(function);
+    }
+
+    void run() {
+        // Optimistic: recursive functions are pure unless something
+        // they call is not
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            for(auto function : functions) {
+                if(!pure[function])
+                    continue;
+                for(auto callee : callees[function]) {
+                    auto it = pure.find(callee);
+                    if(it == pure.end() || !it->second) {
+                        pure[function] = false;
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        for(auto function : functions)
+            function->setPure(pure[function]);
+    }
+
+private:
+    void collect(Function *function) {
+        functions.push_back(function);
+        pure[function] = candidate(function, callees[function]);
+        for(std::size_t i = 0; i < function->childCount(); ++i)
+            collect(function->getChild(i));
+    }
+
+    // Whether function may be pure, given that the prototypes its
+    // upvalues are bound to, stored to callees, are pure
+    bool candidate(Function *function, std::vector<Function *> &callees) {
+        if(function->isDeferred() || function->childCount() != 0)
+            return false;
+        int n = function->codeSize();
+        for(int i = 0; i < n; ++i)
+            if(function->getCode(i)->op == Code::SetUpval)
+                return false;
+
+        for(int j = 0; j < function->upvalueCount(); ++j) {
+            auto callee = boundPrototype(function, j);
+            if(!callee)
+                return false;
+            callees.push_back(callee);
+        }
+        return true;
+    }
+
+    // Prototype of the only closure the local behind upvalue j of function
+    // is ever bound to, null if it may hold anything else
+    Function *boundPrototype(Function *function, int j) {
+        auto info = function->getUpvalueInfo(j);
+        auto owner = function->getParent();
+        while(!info->isParentLocal) {
+            info = owner->getUpvalueInfo(info->registerIndex);
+            owner = owner->getParent();
+        }
+        int reg = info->registerIndex;
+        if(reg < owner->paramCount())
+            return nullptr;
+
+        int n = owner->codeSize();
+        int top = owner->slotCount();
+        const Code *def = nullptr;
+        std::vector<int> defs;
+        for(int i = 0; i < n; ++i) {
+            defs.clear();
+            owner->getCode(i)->getDefs(defs, top);
+            for(auto r : defs) {
+                if(r != reg)
+                    continue;
+                if(def)
+                    return nullptr;
+                def = owner->getCode(i);
+            }
+        }
+        if(!def || (def->op != Code::Closure && def->op != Code::ClosureLocal))
+            return nullptr;
+
+        // Assigned through an upvalue by some child of the owner
+        if(writesCaptured(owner, reg))
+            return nullptr;
+        return owner->getChild(def->arg1);
+    }
+
+    std::vector<Function *> functions;
+    std::unordered_map<Function *, bool> pure;
+    // Prototypes bound to the upvalues of each function
+    std::unordered_map<Function *, std::vector<Function *>> callees;
+};
+
+void analyzePurity(Function *function)
+{
+    PurityAnalysis(function).run();
+}
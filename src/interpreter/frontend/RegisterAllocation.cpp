@@ -0,0 +1,607 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "Optimizer.h"
+#include "Function.h"
+#include <vector>
+#include <algorithm>
+
+using std::vector;
+
+// Register operand of an instruction and the web it belongs to
+struct RegisterRef {
+    int reg;
+    int web;
+
+    RegisterRef(int reg, int web): reg(reg), web(web) {}
+};
+
+// Register allocation of one function. Temporaries and locals of inner
+// scopes are split into webs, i.e. definitions joined by the uses they
+// reach. Webs which must stay adjacent (call arguments and results, the
+// registers of a for loop) are grouped into blocks, and blocks are placed
+// in order of their first use into the lowest registers free wherever
+// their webs are live. Locals of the outer scope keep their registers.
+class RegisterAllocator {
+public:
+    RegisterAllocator(Function *function)
+        :function(function), n(function->codeSize()), fixed(function->outerLocalCount()),
+        top(function->slotCount()) {
+    }
+
+    // Return false when the function is left unchanged
+    bool run() {
+        return check() && computeLiveness() && buildWebs() && collectCalls()
+                && buildBlocks() && place() && rewrite();
+    }
+
+private:
+    enum {
+        Unset = -0x7fffffff
+    };
+
+    // Registers written by code, a call only counts its results. A call
+    // with results count -1 inside an expression yields R(A) only.
+    void getWrites(const Code &code, vector<int> &regs) const {
+        if(code.op == Code::Call) {
+            int n = code.result == -1 ? 1 : code.result;
+            for(int i = 0; i < n; ++i)
+                regs.push_back(code.arg1 + i);
+        } else {
+            code.getDefs(regs, top);
+        }
+    }
+
+    // First register of instructions addressing adjacent registers, -1 if none
+    static int rangeBase(const Code &code) {
+        switch(code.op) {
+        case Code::Call:
+        case Code::ForPrep:
+        case Code::ForLoop:
+        case Code::ForPrepInt:
+        case Code::ForLoopInt:
+            return code.arg1;
+        case Code::Return:
+        case Code::Nil:
+        case Code::NewArray:
+            return code.arg2 > 0 ? code.arg1 : -1;
+        default:
+            return -1;
+        }
+    }
+
+    bool check() {
+        if(n == 0)
+            return false;
+        for(int pc = 0; pc < n; ++pc) {
+            auto code = function->getCode(pc);
+            // The count of values passed is only known at runtime
+            if((code->op == Code::Call && code->arg2 == -1)
+                    || (code->op == Code::Return && code->arg2 == -1))
+                return false;
+        }
+        // Upvalues refer to registers of inner scopes by index
+        for(std::size_t i = 0; i < function->childCount(); ++i) {
+            auto child = function->getChild(i);
+            for(int j = 0; j < child->upvalueCount(); ++j) {
+                auto info = child->getUpvalueInfo(j);
+                if(info->isParentLocal && info->registerIndex >= fixed)
+                    return false;
+            }
+        }
+
+        successors.assign(n, vector<int>());
+        predecessors.assign(n, vector<int>());
+        writes.assign(n, vector<int>());
+        reads.assign(n, vector<int>());
+        for(int pc = 0; pc < n; ++pc) {
+            auto code = function->getCode(pc);
+            if(code->fallsThrough() && pc + 1 < n)
+                successors[pc].push_back(pc + 1);
+            if(code->isJump())
+                successors[pc].push_back(code->result);
+            for(auto s : successors[pc])
+                predecessors[s].push_back(pc);
+            getWrites(*code, writes[pc]);
+            code->getUses(reads[pc], top);
+        }
+        return true;
+    }
+
+    // Liveness of registers
+    bool computeLiveness() {
+        liveIn.assign(n, vector<bool>(top, false));
+        liveOut.assign(n, vector<bool>(top, false));
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            for(int pc = n - 1; pc >= 0; --pc) {
+                vector<bool> out(top, false);
+                for(auto s : successors[pc])
+                    for(int r = 0; r < top; ++r)
+                        out[r] = out[r] || liveIn[s][r];
+                vector<bool> in = out;
+                for(auto r : writes[pc])
+                    in[r] = false;
+                for(auto r : reads[pc])
+                    in[r] = true;
+                if(out != liveOut[pc] || in != liveIn[pc]) {
+                    liveOut[pc].swap(out);
+                    liveIn[pc].swap(in);
+                    changed = true;
+                }
+            }
+        }
+        return true;
+    }
+
+    // Union-find over definitions
+    int find(int x) {
+        while(parent[x] != x)
+            x = parent[x] = parent[parent[x]];
+        return x;
+    }
+
+    // Reaching definitions, where definitions of a register meeting at a
+    // point the register is live are joined into one web
+    bool buildWebs() {
+        // Fixed registers are one web each, then one node per definition
+        for(int r = 0; r < fixed; ++r)
+            parent.push_back(r);
+        defNode.assign(n, vector<int>());
+        for(int pc = 0; pc < n; ++pc) {
+            for(auto r : writes[pc]) {
+                int node = r;
+                if(r >= fixed) {
+                    node = parent.size();
+                    parent.push_back(node);
+                }
+                defNode[pc].push_back(node);
+            }
+        }
+
+        reaching.assign(n, vector<int>(top, -1));
+        vector<int> out(top);
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            for(int pc = 0; pc < n; ++pc) {
+                for(int r = fixed; r < top; ++r) {
+                    int current = reaching[pc][r];
+                    for(auto p : predecessors[pc]) {
+                        int x = reachingOut(p, r);
+                        if(x == -1)
+                            continue;
+                        x = find(x);
+                        if(current == -1) {
+                            current = x;
+                        } else if(find(current) != x && liveIn[pc][r]) {
+                            parent[x] = find(current);
+                            changed = true;
+                        }
+                    }
+                    if(current != -1)
+                        current = find(current);
+                    if(current != reaching[pc][r]) {
+                        reaching[pc][r] = current;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        // Number the webs
+        vector<int> &number = webOfNode;
+        number.assign(parent.size(), -1);
+        nwebs = 0;
+        for(std::size_t i = 0; i < parent.size(); ++i) {
+            int root = find(i);
+            if(number[root] == -1)
+                number[root] = nwebs++;
+        }
+        webRegister.assign(nwebs, -1);
+        uses.assign(n, vector<RegisterRef>());
+        defs.assign(n, vector<RegisterRef>());
+        for(int pc = 0; pc < n; ++pc) {
+            for(auto r : reads[pc]) {
+                int node = r < fixed ? r : reaching[pc][r];
+                // Temporary read before written
+                if(node == -1)
+                    return false;
+                uses[pc].push_back(RegisterRef(r, number[find(node)]));
+            }
+            for(std::size_t i = 0; i < writes[pc].size(); ++i)
+                defs[pc].push_back(RegisterRef(writes[pc][i], number[find(defNode[pc][i])]));
+            for(auto &ref : uses[pc])
+                webRegister[ref.web] = ref.reg;
+            for(auto &ref : defs[pc])
+                webRegister[ref.web] = ref.reg;
+        }
+
+        // A web occupies its register where it is written or live afterwards
+        occupied.assign(nwebs, vector<int>());
+        firstPoint.assign(nwebs, n);
+        for(int pc = 0; pc < n; ++pc) {
+            for(auto &ref : uses[pc])
+                firstPoint[ref.web] = std::min(firstPoint[ref.web], pc);
+            for(auto &ref : defs[pc])
+                occupied[ref.web].push_back(pc);
+            for(int r = 0; r < top; ++r) {
+                if(!liveOut[pc][r])
+                    continue;
+                int w = webAfter(pc, r);
+                if(w == -1)
+                    return false;
+                if(occupied[w].empty() || occupied[w].back() != pc)
+                    occupied[w].push_back(pc);
+            }
+        }
+        for(int w = 0; w < nwebs; ++w)
+            if(!occupied[w].empty())
+                firstPoint[w] = std::min(firstPoint[w], occupied[w].front());
+        return true;
+    }
+
+    // Definition node of register r after executing code pc
+    int reachingOut(int pc, int r) const {
+        for(std::size_t i = 0; i < writes[pc].size(); ++i)
+            if(writes[pc][i] == r)
+                return defNode[pc][i];
+        return reaching[pc][r];
+    }
+
+    // Web of register r after executing code pc
+    int webAfter(int pc, int r) {
+        if(r < fixed)
+            return webOfNode[find(r)];
+        int node = reachingOut(pc, r);
+        return node == -1 ? -1 : webOfNode[find(node)];
+    }
+
+    // Webs living across calls must stay below the called closure, because
+    // the callee frame and the results overwrite all registers above it
+    bool collectCalls() {
+        closureOf.assign(nwebs, vector<int>());
+        acrossOf.assign(nwebs, vector<int>());
+        for(int pc = 0; pc < n; ++pc) {
+            auto code = function->getCode(pc);
+            if(code->op != Code::Call)
+                continue;
+            int index = callClosure.size();
+            callClosure.push_back(webAt(uses[pc], code->arg1));
+            callAcross.push_back(vector<int>());
+            closureOf[callClosure.back()].push_back(index);
+            for(int r = 0; r < top; ++r) {
+                if(!liveOut[pc][r] || webAt(defs[pc], r) != -1)
+                    continue;
+                // The original code reads a register overwritten by the call
+                if(r >= code->arg1)
+                    return false;
+                int w = webAfter(pc, r);
+                if(w == -1)
+                    return false;
+                callAcross[index].push_back(w);
+                acrossOf[w].push_back(index);
+            }
+        }
+        return true;
+    }
+
+    static int webAt(const vector<RegisterRef> &refs, int reg) {
+        for(auto &ref : refs)
+            if(ref.reg == reg)
+                return ref.web;
+        return -1;
+    }
+
+    // Union-find over webs with offsets: reg(x) = reg(root) + offset(x)
+    int findBlock(int x, int &offset) const {
+        offset = 0;
+        while(block[x] != x) {
+            offset += blockOffset[x];
+            x = block[x];
+        }
+        return x;
+    }
+
+    // Require reg(a) = reg(b) + d
+    bool link(int a, int b, int d) {
+        int oa, ob;
+        int ra = findBlock(a, oa);
+        int rb = findBlock(b, ob);
+        if(ra == rb)
+            return oa == ob + d;
+        block[ra] = rb;
+        blockOffset[ra] = ob + d - oa;
+        return true;
+    }
+
+    bool buildBlocks() {
+        block.resize(nwebs);
+        blockOffset.assign(nwebs, 0);
+        for(int w = 0; w < nwebs; ++w)
+            block[w] = w;
+
+        for(int pc = 0; pc < n; ++pc) {
+            int base = rangeBase(*function->getCode(pc));
+            if(base == -1)
+                continue;
+            int anchor = webAt(uses[pc], base);
+            if(anchor == -1)
+                anchor = webAt(defs[pc], base);
+            if(anchor == -1)
+                return false;
+            for(auto &ref : uses[pc])
+                if(!link(ref.web, anchor, ref.reg - base))
+                    return false;
+            // The result of NewArray is not part of its element range
+            if(function->getCode(pc)->op == Code::NewArray)
+                continue;
+            for(auto &ref : defs[pc])
+                if(!link(ref.web, anchor, ref.reg - base))
+                    return false;
+        }
+
+        // Blocks holding fixed registers keep the original numbering
+        offsetInBlock.resize(nwebs);
+        blockOf.resize(nwebs);
+        members.assign(nwebs, vector<int>());
+        blockBase.assign(nwebs, Unset);
+        for(int w = 0; w < nwebs; ++w) {
+            int root = findBlock(w, offsetInBlock[w]);
+            blockOf[w] = root;
+            members[root].push_back(w);
+            if(webRegister[w] >= 0 && webRegister[w] < fixed) {
+                int base = webRegister[w] - offsetInBlock[w];
+                if(blockBase[root] != Unset && blockBase[root] != base)
+                    return false;
+                blockBase[root] = base;
+            }
+        }
+        return true;
+    }
+
+    // Whether web w may use register reg given the webs placed so far
+    bool fits(int w, int reg) const {
+        if(reg < 0 || (reg < fixed && webRegister[w] != reg))
+            return false;
+        if(reg >= (int)slots.size())
+            return true;
+        for(auto pc : occupied[w])
+            if(slots[reg][pc])
+                return false;
+        return true;
+    }
+
+    // Whether the calls involving web w hold with w at register reg
+    bool callsHold(int w, int reg) const {
+        for(auto i : closureOf[w])
+            for(auto across : callAcross[i])
+                if(assigned[across] != -1 && assigned[across] >= reg)
+                    return false;
+        for(auto i : acrossOf[w]) {
+            int closure = assigned[callClosure[i]];
+            if(closure != -1 && reg >= closure)
+                return false;
+        }
+        return true;
+    }
+
+    void occupy(int w, int reg) {
+        while((int)slots.size() <= reg)
+            slots.push_back(vector<bool>(n, false));
+        for(auto pc : occupied[w])
+            slots[reg][pc] = true;
+        assigned[w] = reg;
+    }
+
+    // Try to place all webs of block root at base
+    bool tryPlace(int root, int base) {
+        for(auto w : members[root])
+            if(!fits(w, base + offsetInBlock[w]))
+                return false;
+        bool ok = true;
+        for(auto w : members[root])
+            assigned[w] = base + offsetInBlock[w];
+        for(auto w : members[root])
+            ok = ok && callsHold(w, base + offsetInBlock[w]);
+        for(auto w : members[root])
+            assigned[w] = -1;
+        if(!ok)
+            return false;
+        for(auto w : members[root])
+            occupy(w, base + offsetInBlock[w]);
+        return true;
+    }
+
+    int start(int root) const {
+        int s = n;
+        for(auto w : members[root])
+            s = std::min(s, firstPoint[w]);
+        return s;
+    }
+
+    bool place() {
+        assigned.assign(nwebs, -1);
+
+        // Blocks of fixed registers first, then the others by first use
+        vector<int> order;
+        for(int w = 0; w < nwebs; ++w) {
+            if(blockOf[w] != w)
+                continue;
+            if(blockBase[w] != Unset) {
+                if(!tryPlace(w, blockBase[w]))
+                    return false;
+            } else {
+                order.push_back(w);
+            }
+        }
+        std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+            return start(a) < start(b);
+        });
+
+        int limit = top + nwebs;
+        for(auto root : order) {
+            int low = 0;
+            for(auto w : members[root])
+                low = std::min(low, offsetInBlock[w]);
+            bool placed = false;
+            for(int base = fixed - low; base < limit && !placed; ++base)
+                placed = tryPlace(root, base);
+            if(!placed)
+                return false;
+        }
+        return true;
+    }
+
+    int physical(const vector<RegisterRef> &refs, int reg) const {
+        return assigned[webAt(refs, reg)];
+    }
+
+    bool rewrite() {
+        for(int pc = 0; pc < n; ++pc) {
+            auto code = function->getCode(pc);
+            switch(code->op) {
+            case Code::Add:
+            case Code::Sub:
+            case Code::Mul:
+            case Code::Div:
+            case Code::Pow:
+            case Code::Mod:
+            case Code::Lt:
+            case Code::Le:
+            case Code::Gt:
+            case Code::Ge:
+            case Code::Eq:
+            case Code::Ne:
+            case Code::Jlt:
+            case Code::Jle:
+            case Code::Jgt:
+            case Code::Jge:
+            case Code::Jeq:
+            case Code::Jne:
+            case Code::GetIndex:
+                if(code->arg1 >= 0)
+                    code->arg1 = physical(uses[pc], code->arg1);
+                if(code->arg2 >= 0)
+                    code->arg2 = physical(uses[pc], code->arg2);
+                if(!code->isJump())
+                    code->result = physical(defs[pc], code->result);
+                break;
+            case Code::Minus:
+            case Code::Move:
+                if(code->arg1 >= 0)
+                    code->arg1 = physical(uses[pc], code->arg1);
+                code->result = physical(defs[pc], code->result);
+                break;
+            case Code::Jnz:
+            case Code::SetUpval:
+                if(code->arg1 >= 0)
+                    code->arg1 = physical(uses[pc], code->arg1);
+                break;
+            case Code::GetUpval:
+            case Code::Closure:
+            case Code::ClosureLocal:
+            case Code::Bool:
+                code->result = physical(defs[pc], code->result);
+                break;
+            case Code::Call:
+            case Code::Return:
+            case Code::ForPrep:
+            case Code::ForLoop:
+            case Code::ForPrepInt:
+            case Code::ForLoopInt:
+                if(rangeBase(*code) != -1)
+                    code->arg1 = physical(uses[pc], code->arg1);
+                break;
+            case Code::Nil:
+                if(rangeBase(*code) != -1)
+                    code->arg1 = physical(defs[pc], code->arg1);
+                break;
+            case Code::NewArray:
+                if(rangeBase(*code) != -1)
+                    code->arg1 = physical(uses[pc], code->arg1);
+                code->result = physical(defs[pc], code->result);
+                break;
+            case Code::SetIndex:
+                code->arg1 = physical(uses[pc], code->arg1);
+                if(code->arg2 >= 0)
+                    code->arg2 = physical(uses[pc], code->arg2);
+                if(code->result >= 0)
+                    code->result = physical(uses[pc], code->result);
+                break;
+            default:
+                break;
+            }
+        }
+        function->recountSlots();
+        return true;
+    }
+
+    Function *function;
+    // Count of codes
+    int n;
+    // Registers of outer scope locals, never renumbered
+    int fixed;
+    // Count of registers before allocation
+    int top;
+
+    // Control flow and registers accessed by each code
+    vector<vector<int> > successors;
+    vector<vector<int> > predecessors;
+    vector<vector<int> > writes;
+    vector<vector<int> > reads;
+    vector<vector<bool> > liveIn;
+    vector<vector<bool> > liveOut;
+
+    // Definition nodes and the node reaching each code for each register
+    vector<int> parent;
+    vector<vector<int> > defNode;
+    vector<vector<int> > reaching;
+    vector<int> webOfNode;
+
+    // Webs, their original registers and the codes they occupy
+    int nwebs;
+    vector<int> webRegister;
+    vector<vector<RegisterRef> > uses;
+    vector<vector<RegisterRef> > defs;
+    vector<vector<int> > occupied;
+    vector<int> firstPoint;
+
+    // Calls: web of the closure and webs living across
+    vector<int> callClosure;
+    vector<vector<int> > callAcross;
+    vector<vector<int> > closureOf;
+    vector<vector<int> > acrossOf;
+
+    // Blocks of adjacent webs
+    vector<int> block;
+    vector<int> blockOffset;
+    vector<int> blockOf;
+    vector<int> offsetInBlock;
+    vector<vector<int> > members;
+    vector<int> blockBase;
+
+    // Register of each web and the codes each register is occupied at
+    vector<int> assigned;
+    vector<vector<bool> > slots;
+};
+
+void allocateRegisters(Function *function)
+{
+    function->recountSlots();
+    RegisterAllocator allocator(function);
+    allocator.run();
+}
@@ -30,6 +30,7 @@ static const char *desc[] = {
     "LocalSymbol",
     "Upvalue",
     "Boolean",
+    "Element",
 };
 
 struct SemanticInfo {
@@ -42,12 +43,14 @@ struct SemanticInfo {
         LocalSymbol,
         Upvalue,
         Boolean,
+        Element,
     };
 
     SemanticType type;
     int index;
     int codeIndex;
     string name;		// identifier
+    int key;    // key of array Element, register or constant
     int tc; // truelist
     int fc; // falselist
 
@@ -0,0 +1,258 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include "Optimizer.h"
+#include "Function.h"
+#include <vector>
+
+// Type of a register at a program point. Unset is used before any path
+// reaching the point is known, Any when the type is not proven.
+enum Type { Unset, Integer, Real, Any };
+
+typedef std::vector<Type> TypeState;
+
+static Type join(Type a, Type b)
+{
+    if(a == Unset || a == b)
+        return b;
+    if(b == Unset)
+        return a;
+    return Any;
+}
+
+static bool numeric(Type t)
+{
+    return t == Integer || t == Real;
+}
+
+// Result type of Add, Sub or Mul
+static Type arithmetic(Type a, Type b)
+{
+    if(a == Integer && b == Integer)
+        return Integer;
+    if(numeric(a) && numeric(b))
+        return Real;
+    return Any;
+}
+
+class TypeInference {
+public:
+    TypeInference(Function *function):function(function) {
+        n = function->codeSize();
+        top = function->slotCount();
+
+        // Registers which children may assign through upvalues
+        findCaptured(function, captured);
+    }
+
+    void run() {
+        analyze();
+        for(int pc = 0; pc < n; ++pc)
+            if(!in[pc].empty())
+                rewrite(pc);
+    }
+
+private:
+    // Operands of codes not reading registers, like the upvalue index of
+    // GetUpval, may be past the top and are never typed
+    Type typeOf(const TypeState &state, int rk) const {
+        if(rk >= top)
+            return Any;
+        if(rk >= 0)
+            return captured[rk] ? Any : state[rk];
+        switch(function->getConstant(-rk).type) {
+        case Operand::IntegerType:
+            return Integer;
+        case Operand::RealType:
+            return Real;
+        default:
+            return Any;
+        }
+    }
+
+    // Types of registers after code c runs with types state
+    void transfer(const Code &c, TypeState &state) const {
+        Type t;
+        switch(c.op) {
+        case Code::Add:
+        case Code::Sub:
+        case Code::Mul:
+            t = arithmetic(typeOf(state, c.arg1), typeOf(state, c.arg2));
+            break;
+        case Code::Div:
+        case Code::Pow:
+            t = numeric(typeOf(state, c.arg1)) && numeric(typeOf(state, c.arg2)) ? Real : Any;
+            break;
+        case Code::Minus:
+            t = typeOf(state, c.arg1);
+            t = numeric(t) ? t : Any;
+            break;
+        case Code::Move:
+            t = typeOf(state, c.arg1);
+            break;
+        case Code::Lt:
+        case Code::Le:
+        case Code::Gt:
+        case Code::Ge:
+        case Code::Eq:
+        case Code::Ne:
+        case Code::Bool:
+            t = Integer;
+            break;
+        case Code::ForPrep:
+            state[c.arg1 + 3] = arithmetic(state[c.arg1], state[c.arg1 + 2]);
+            return;
+        case Code::ForLoop:
+            state[c.arg1 + 3] = arithmetic(state[c.arg1 + 3], state[c.arg1 + 2]);
+            return;
+        case Code::ForPrepInt:
+        case Code::ForLoopInt:
+            state[c.arg1 + 1] = Integer;
+            state[c.arg1 + 3] = Integer;
+            return;
+        default: {
+            std::vector<int> defs;
+            c.getDefs(defs, top);
+            for(auto r : defs)
+                state[r] = Any;
+            return;
+        }
+        }
+        state[c.result] = t;
+    }
+
+    // Merge state into the types at the entry of code pc
+    bool flow(int pc, const TypeState &state) {
+        if(pc < 0 || pc >= n)
+            return false;
+        if(in[pc].empty()) {
+            in[pc] = state;
+            return true;
+        }
+        bool changed = false;
+        for(int r = 0; r < top; ++r) {
+            auto t = join(in[pc][r], state[r]);
+            if(t != in[pc][r]) {
+                in[pc][r] = t;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    // Forward data flow from the entry, where nothing is known.
+    // Codes never reached keep an empty state.
+    void analyze() {
+        in.assign(n, TypeState());
+        if(n == 0)
+            return;
+        in[0].assign(top, Any);
+        bool changed = true;
+        while(changed) {
+            changed = false;
+            for(int pc = 0; pc < n; ++pc) {
+                if(in[pc].empty())
+                    continue;
+                auto c = function->getCode(pc);
+                TypeState out = in[pc];
+                transfer(*c, out);
+                if(c->fallsThrough())
+                    changed |= flow(pc + 1, out);
+                if(c->isJump())
+                    changed |= flow(c->result, out);
+            }
+        }
+    }
+
+    // Operand rk of type t as a real, integer constants are converted
+    bool realOperand(int &rk, Type t) {
+        if(t == Real)
+            return true;
+        if(t != Integer || rk >= 0)
+            return false;
+        rk = -(int)function->addConstant(Operand((double)function->getConstant(-rk).integer));
+        return true;
+    }
+
+    // Both operands of c as reals. Converting integer constants gives the
+    // same result as the generic code mixing them with reals.
+    bool realOperands(Code &c, Type a, Type b) {
+        if(a != Real && b != Real)
+            return false;
+        int arg1 = c.arg1, arg2 = c.arg2;
+        if(!realOperand(arg1, a) || !realOperand(arg2, b))
+            return false;
+        c.arg1 = arg1;
+        c.arg2 = arg2;
+        return true;
+    }
+
+    // Only the conditional jumps of comparisons are typed. Lt to Ne are
+    // emitted just for comparisons stored as values, like b = x < y,
+    // which are rare next to tests in if and while, and they already
+    // produce an Integer for the codes reading them.
+    void rewrite(int pc) {
+        auto c = function->getCode(pc);
+        Type a = typeOf(in[pc], c->arg1);
+        Type b = typeOf(in[pc], c->arg2);
+
+        static const Code::OpCode integerArith[] = { Code::AddI, Code::SubI, Code::MulI };
+        static const Code::OpCode realArith[] = { Code::AddR, Code::SubR, Code::MulR, Code::DivR };
+        static const Code::OpCode integerJumps[] = { Code::JltI, Code::JleI, Code::JgtI, Code::JgeI };
+        static const Code::OpCode realJumps[] = { Code::JltR, Code::JleR, Code::JgtR, Code::JgeR };
+
+        switch(c->op) {
+        case Code::Add:
+        case Code::Sub:
+        case Code::Mul:
+            if(a == Integer && b == Integer)
+                c->op = integerArith[c->op - Code::Add];
+            else if(realOperands(*c, a, b))
+                c->op = realArith[c->op - Code::Add];
+            break;
+        case Code::Div:
+            if(realOperands(*c, a, b))
+                c->op = Code::DivR;
+            break;
+        case Code::Jlt:
+        case Code::Jle:
+        case Code::Jgt:
+        case Code::Jge:
+            // Comparisons of integers with reals are left generic, they
+            // do not convert the integer
+            if(a == Integer && b == Integer)
+                c->op = integerJumps[c->op - Code::Jlt];
+            else if(a == Real && b == Real)
+                c->op = realJumps[c->op - Code::Jlt];
+            break;
+        default:
+            break;
+        }
+    }
+
+    Function *function;
+    int n;
+    int top;
+    // Registers which may change behind calls
+    std::vector<bool> captured;
+    // Types at the entry of each code
+    std::vector<TypeState> in;
+};
+
+void inferTypes(Function *function)
+{
+    TypeInference(function).run();
+}
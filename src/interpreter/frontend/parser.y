@@ -25,6 +25,9 @@
 // Request verbose, specific error message strings when yyerror is called.
 #define YYERROR_VERBOSE 1
 
+// Start skipping a function body, it is returned as TOKEN_BODY
+void skipFunctionBody(yyscan_t scanner);
+
 // Function yyerror is called whenever bison detects a syntax error
 void yyerror (YYLTYPE *locp, Function *function, yyscan_t scanner, char const *msg) {
 	std::cout << locp->first_line << "," << locp->first_column << ": syntax error!" << std::endl;
@@ -63,7 +66,7 @@ typedef void* yyscan_t;
 
 /* The %destructor directive defines code that is called when a symbol is automatically discarded during error recovery. */
 %destructor { 
-	printf("%d,%d: free discarded symbols\n", @$.first_line, @$.first_column);
+	std::cout << @$.first_line << "," << @$.first_column << ": free discarded symbols" << std::endl;
 	destroy($$);
 } <info>
  
@@ -89,6 +92,7 @@ typedef void* yyscan_t;
 %token <real> TOKEN_REAL
 %token <integer> TOKEN_INTEGER
 %token <id> TOKEN_IDENTIFIER
+%token <id> TOKEN_BODY
  
 %type <info> if_condition 
 %type <info> for_range 
@@ -137,7 +141,7 @@ statement
 	| return_statement
 	| TOKEN_FUNCTION TOKEN_IDENTIFIER '(' optional_parameter_list ')'
 	{
-		int funcindex = function->createChild("anonymous");
+		int funcindex = function->createChild(string($2.str, $2.len));
 		int temp = function->localSymbolCount();
 		function->addLocalSymbolInfo(LocalSymbolInfo(string($2.str, $2.len), temp));
 		function->addCode(Code(Code::Closure, funcindex, 0, temp), @1.first_line);
@@ -152,21 +156,35 @@ statement
 			}
 		}
 		destroy($4);
+		if(function->isLazy())
+			skipFunctionBody(scanner);
 	}
-	statement_list TOKEN_END
+	function_body
 	{
-		function->addCode(Code(Code::Return, 0, 0, 0), @8.first_line);
 		function = function->getParent();
 		//$$ = $<info>6;
 	}
 	;
 
+function_body
+	: statement_list TOKEN_END
+	{
+		function->addCode(Code(Code::Return, 0, 0, 0), @2.first_line);
+	}
+	| TOKEN_BODY
+	{
+		deferFunctionBody(function, string($1.str, $1.len), @1.first_line);
+	}
+	;
+
 return_statement
 	: TOKEN_RETURN expression_list
 	{
 		int n = count($2);
 		// Move the last value to tempraries. Note that the first n-1 $3ession values and function call result(s) are  already temparies.
-		if($2->prev->info->index < function->localSymbolCount()) {
+		if($2->prev->info->type == SemanticInfo::Boolean) {
+			codegenValue(function, $2->prev, @1.first_line);
+		} else if($2->prev->info->index < function->localSymbolCount()) {
 			int temp = function->newTemp();
 			function->addCode(Code(Code::Move, $2->prev->info->index, 0, temp), @1.first_line);
 			$2->prev->info->index = temp;
@@ -291,6 +309,15 @@ assignment_statement
 	{
 		int m = count($1);
 		int n = count($3);
+		// The key of an array element would be read after assigning
+		// the other targets
+		auto target = $1;
+		for(int i = 0; i < m && m > 1; ++i, target = target->next) {
+			if(target->info->type == SemanticInfo::Element) {
+				std::cout << "Array element in multiple assignment" << std::endl;
+				YYERROR;
+			}
+		}
 		// Move the last value to tempraries. Note that the first n-1 $3ession values and function call result(s) are  already temparies.
 		if((n > 1 && $3->prev->info->type != SemanticInfo::FunctionCall) || $3->prev->info->type == SemanticInfo::Boolean) {
 			if($3->prev->info->type != SemanticInfo::Boolean) {
@@ -298,15 +325,7 @@ assignment_statement
 				function->addCode(Code(Code::Move, $3->prev->info->index, 0, temp), @1.first_line);
 				$3->prev->info->index = temp;
 			} else {
-				std::cout << "bool\n";
-				int temp = function->newTemp();
-				int tend = function->addCode(Code(Code::Bool, 1, 0, temp), @1.first_line);
-				int jend = function->addCode(Code(Code::Jmp, 0, 0, -1), @1.first_line);
-				int fend = function->addCode(Code(Code::Bool, 0, 0, temp), @1.first_line);
-				function->backpatch($3->prev->info->tc, tend);
-				function->backpatch($3->prev->info->fc, fend);
-				function->backpatch(jend);
-				$3->prev->info->index = temp;
+				codegenValue(function, $3->prev, @1.first_line);
 			}
 		}
 		
@@ -324,9 +343,9 @@ assignment_statement
 		}
 		
 		// Retrieve symbols or enter symbols if not defined
-		auto target = $1;
+		target = $1;
 		for(int i = 0; i < m; ++i) {
-			if(!retrieveSymbol(function, target->info))
+			if(target->info->type != SemanticInfo::Element && !retrieveSymbol(function, target->info))
 				enterSymbol(function, target->info);
 			target = target->next;
 		}
@@ -337,7 +356,7 @@ assignment_statement
 		int index = $3->info->index+m-1;
 		// Assign the last target
 		// if the last expression is temperary, rewrite code
-		if($3->prev->info->index >= function->localSymbolCount()) {
+		if(target->info->type != SemanticInfo::Element && $3->prev->info->index >= function->localSymbolCount()) {
 			auto code = function->getCode(function->codeSize()-1);
 			code->result = target->info->index;
 			cnt--; 
@@ -371,6 +390,23 @@ target
 	{
 		$$ = new Semantic(new SemanticInfo(SemanticInfo::Identifier, string($1.str, $1.len)));
 	}
+	| TOKEN_IDENTIFIER '[' expression ']'
+	{
+		$$ = new Semantic(new SemanticInfo(SemanticInfo::Identifier, string($1.str, $1.len)));
+		if(!retrieveSymbol(function, $$->info)) {
+			std::cout << "Undefined symbol:" << string($1.str, $1.len) << std::endl;
+			YYERROR;
+		}
+		if($$->info->type == SemanticInfo::Upvalue) {
+			int temp = function->newTemp();
+			function->addCode(Code(Code::GetUpval, $$->info->index, 0, temp), @1.first_line);
+			$$->info->index = temp;
+		}
+		codegenOperand(function, $3, @3.first_line);
+		$$->info->type = SemanticInfo::Element;
+		$$->info->key = $3->info->index;
+		destroy($3);
+	}
 	;
 
 expression_list
@@ -408,10 +444,11 @@ function_definition
 			}
 		}
 		destroy($3);
+		if(function->isLazy())
+			skipFunctionBody(scanner);
 	}
-	statement_list TOKEN_END
+	function_body
 	{
-		function->addCode(Code(Code::Return, 0, 0, 0), @7.first_line);
 		function = function->getParent();
 		$$ = $<info>5;
 	}
@@ -603,6 +640,22 @@ exponential_expression
 postfix_expression
 	: primary_expression
 	| function_call
+	| postfix_expression[L] '[' expression[R] ']'
+	{
+		codegenOperand(function, $L, @1.first_line);
+		codegenOperand(function, $R, @3.first_line);
+		// Constants have no elements, let it fail at runtime
+		if($L->info->index < 0) {
+			int temp = function->newTemp();
+			function->addCode(Code(Code::Move, $L->info->index, 0, temp), @1.first_line);
+			$L->info->index = temp;
+		}
+		int temp = function->newTemp($L->info->index, $R->info->index);
+		function->addCode(Code(Code::GetIndex, $L->info->index, $R->info->index, temp), @2.first_line);
+		$$ = new Semantic(new SemanticInfo(SemanticInfo::Expression, temp));
+		destroy($L);
+		destroy($R);
+	}
 	;
 
 function_call
@@ -641,7 +694,9 @@ optional_argument_list
 	| expression_list
 	{
 		// Move all expressions to tempraries
-		if($1->prev->info->type != SemanticInfo::FunctionCall && $1->prev->info->index < function->localSymbolCount()) {
+		if($1->prev->info->type == SemanticInfo::Boolean) {
+			codegenValue(function, $1->prev, @1.first_line);
+		} else if($1->prev->info->type != SemanticInfo::FunctionCall && $1->prev->info->index < function->localSymbolCount()) {
 			int temp = function->newTemp();
 			function->addCode(Code(Code::Move, $1->prev->info->index, 0, temp), @1.first_line);
 			$1->prev->info->index = temp;
@@ -652,6 +707,21 @@ optional_argument_list
 	
 primary_expression
 	: '(' additive_expression ')'  { $$ = $2; }
+	| '[' ']'
+	{
+		int temp = function->newTemp();
+		function->addCode(Code(Code::NewArray, 0, 0, temp), @1.first_line);
+		$$ = new Semantic(new SemanticInfo(SemanticInfo::Expression, temp));
+	}
+	| '[' expression_list ']'
+	{
+		makeSequence(function, $2, @2.first_line);
+		int first = codegenRange(function, $2, @2.first_line);
+		function->addCode(Code(Code::NewArray, first, count($2), first), @1.first_line);
+		function->setTemp(first + 1);
+		$$ = new Semantic(new SemanticInfo(SemanticInfo::Expression, first));
+		destroy($2);
+	}
 	| constant
 	| TOKEN_IDENTIFIER 
 	{
@@ -665,6 +735,8 @@ primary_expression
 				function->addCode(Code(Code::GetUpval, $$->info->index, 0, temp), @1.first_line);
 				$$->info->index = temp;
 			}
+		} else if(retrieveBuiltin(function, $$->info)) {
+			// do nothing, builtins are constants
 		} else {
 			std::cout << "Undefined symbol:" << string($1.str, $1.len) << std::endl;
 			YYERROR;
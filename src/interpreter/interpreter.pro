@@ -10,6 +10,7 @@ INCLUDEPATH = . frontend backend
 # C++11 on Unix
 unix {
 	QMAKE_CXXFLAGS += -std=c++0x
+	LIBS += -lpthread
 }
 
 # C++11 on Mac OS X
@@ -19,20 +20,54 @@ macx {
 	LIBS += -stdlib=libc++ -mmacosx-version-min=10.7
 }
 
-HEADERS += frontend/Semantic.h \
+HEADERS += Parse.h \
+	FormulaSet.h \
+	Capture.h \
+	Batch.h \
+	frontend/Semantic.h \
 	frontend/CodeGen.h \
+	frontend/Optimizer.h \
+	frontend/Number.h \
 	backend/Code.h \
 	backend/Operand.h \
+	backend/Allocator.h \
 	backend/Function.h \
-	backend/VM.h
+	backend/VM.h \
+	backend/Builtins.h \
+	backend/Array.h \
+	backend/Dual.h \
+	backend/Memo.h \
+	backend/Profiler.h \
+	backend/Metrics.h
 
 SOURCES += main.cpp \
+	Parse.cpp \
+	FormulaSet.cpp \
+	Capture.cpp \
+	Batch.cpp \
 	frontend/Semantic.cpp \
 	frontend/CodeGen.cpp \
+	frontend/Optimizer.cpp \
+	frontend/Inlining.cpp \
+	frontend/CommonSubexpressions.cpp \
+	frontend/LoopOptimization.cpp \
+	frontend/TypeInference.cpp \
+	frontend/Peephole.cpp \
+	frontend/EscapeAnalysis.cpp \
+	frontend/RegisterAllocation.cpp \
+	frontend/Purity.cpp \
+	frontend/Number.cpp \
 	backend/Code.cpp \
 	backend/Operand.cpp \
+	backend/Allocator.cpp \
 	backend/Function.cpp \
-	backend/VM.cpp
+	backend/VM.cpp \
+	backend/Builtins.cpp \
+	backend/Array.cpp \
+	backend/Dual.cpp \
+	backend/Memo.cpp \
+	backend/Profiler.cpp \
+	backend/Metrics.cpp
 
 ######################################################################
 # Generating lexer and parser with custom commands
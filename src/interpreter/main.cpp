@@ -15,89 +15,167 @@
 
 #include <string>
 #include "Function.h"
-#include "parser.h"
-#include "lexer.h"
+#include "Parse.h"
 #include "VM.h"
+#include "Profiler.h"
+#include "Capture.h"
+#include "Batch.h"
 #include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <vector>
 
 using std::string;
 
-int yyparse(Function * function, void *scanner);
+typedef std::chrono::steady_clock Clock;
 
-bool parse(Function *function, const char *expr)
+void showMessage() 
 {
-    yyscan_t scanner;
-    YY_BUFFER_STATE state;
-
-    if (yylex_init(&scanner)) {
-        // couldn't initialize
-        return false;
-    }
-
-    state = yy_scan_string(expr, scanner);
-
-    if (yyparse(function, scanner)) {
-        // error parsing
-        return false;
-    }
-
-    yy_delete_buffer(state, scanner);
-
-    yylex_destroy(scanner);
-
-    return true;
+    std::cout << "Formula 2.0.1\nCopyright (C) 2015-2016, kylinsage@gmail.com\n";
 }
 
-bool parse(Function *function, FILE *fp)
+// Run the main function, then print its profile with the allocation
+// statistics and write the folded stacks to file folded when given
+void execute(VM &vm, Function *function, Profiler *profiler, const char *folded)
 {
-    yyscan_t scanner;
-    YY_BUFFER_STATE state;
-
-    if (yylex_init(&scanner)) {
-        // couldn't initialize
-        return false;
+    std::cout << *function << std::endl;
+    vm.load(function);
+    if(profiler)
+        profiler->reset();
+    vm.run();
+    if(!profiler)
+        return;
+    profiler->report(std::cout);
+    std::cout << vm.getAllocator();
+    if(folded) {
+        std::ofstream os(folded);
+        profiler->writeFoldedStacks(os);
     }
+}
 
-    if(!fp) fp = stdin;
-    state = yy_create_buffer(fp, YY_BUF_SIZE, scanner);
-    yy_switch_to_buffer(state, scanner);
-
-    if (yyparse(function, scanner)) {
-        // error parsing
+// Read the whole file path into source, return false if it cannot be opened
+bool readFile(const string &path, string &source)
+{
+    std::ifstream is(path, std::ios::binary);
+    if(!is)
         return false;
-    }
-
-    yy_delete_buffer(state, scanner);
-
-    yylex_destroy(scanner);
-
+    std::ostringstream os;
+    os << is.rdbuf();
+    source = os.str();
     return true;
 }
 
-void showMessage() 
+std::uint64_t nanoseconds(Clock::duration d)
 {
-    std::cout << "Formula 2.0.1\nCopyright (C) 2015-2016, kylinsage@gmail.com\n";
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
 }
 
-int main(void)
+// Options: -p prints a profile of each program, -f FILE also writes its
+// call stacks to FILE in the folded format of flame graph tools, -c FILE
+// captures each submitted program to FILE for formula-replay, -m FILE
+// rewrites FILE with the VM metrics in Prometheus format after each program.
+// -b evaluates the files given, or each line read, and prints only results,
+// it takes none of the other options. -l compiles the bodies of functions when they are first called.
+int main(int argc, char *argv[])
 {
     Function function("main");
     VM vm;
+    Profiler profiler;
+    Profiler *profiling = nullptr;
+    const char *folded = nullptr;
+    const char *captured = nullptr;
+    const char *metrics = nullptr;
+    bool batch = false;
+    bool interactive = false;
+    std::vector<string> files;
     string input;
+    for(int i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "-p")) {
+            profiling = &profiler;
+            interactive = true;
+        } else if(!strcmp(argv[i], "-f") && i + 1 < argc) {
+            profiling = &profiler;
+            folded = argv[++i];
+            interactive = true;
+        } else if(!strcmp(argv[i], "-c") && i + 1 < argc) {
+            captured = argv[++i];
+            interactive = true;
+        } else if(!strcmp(argv[i], "-m") && i + 1 < argc) {
+            metrics = argv[++i];
+            interactive = true;
+        } else if(!strcmp(argv[i], "-b")) {
+            batch = true;
+        } else if(!strcmp(argv[i], "-l")) {
+            function.setLazy(true);
+            interactive = true;
+        } else {
+            files.push_back(argv[i]);
+        }
+    }
+
+    if(batch && interactive) {
+        std::cerr << "usage: " << argv[0] << " -b [FILE]...\n"
+                  << "-p, -f, -c, -m and -l cannot be used with -b" << std::endl;
+        return 1;
+    }
+    if(batch) {
+        // Only results are written, the output of the compiler is dropped
+        std::ios::sync_with_stdio(false);
+        std::cout.rdbuf(nullptr);
+        return runBatch(files, std::cin, stdout) ? 1 : 0;
+    }
+    vm.setProfiler(profiling);
+
+    std::unique_ptr<CaptureWriter> capture;
+    if(captured) {
+        try {
+            capture.reset(new CaptureWriter(captured));
+        }
+        catch(const char *msg) {
+            std::cerr << msg << ": " << captured << std::endl;
+            return 1;
+        }
+    }
+
     showMessage();
     std::cout << ">>";
     while(getline(std::cin, input)){
         function.clearCodes();
-        FILE *fp = fopen(input.c_str(), "r");
-        if(fp && parse(&function, fp)) {
-            std::cout << function << std::endl;
-            vm.load(&function);
-            vm.run();
-            fclose(fp);
-        } else if(parse(&function, input.c_str())) {
-            std::cout << function << std::endl;
-            vm.load(&function);
-            vm.run();
+        // Scripts are scanned in place where they are mapped, or captured
+        // by their text so that replays do not depend on the file
+        string source;
+        std::size_t children = function.childCount();
+        auto start = Clock::now();
+        bool valid;
+        if(capture) {
+            valid = readFile(input, source) && parse(&function, source.c_str());
+        } else {
+            MappedSource mapped(input.c_str());
+            valid = parse(&function, mapped);
+        }
+        if(!valid) {
+            source = input;
+            valid = parse(&function, source.c_str());
+        }
+        auto compiled = Clock::now();
+        vm.addCompileTime(nanoseconds(compiled - start));
+        if(valid)
+            execute(vm, &function, profiling, folded);
+        if(capture) {
+            CaptureRecord record;
+            record.source = source;
+            record.codes = valid ? compiledSize(&function, children) : 0;
+            record.compileTime = nanoseconds(compiled - start);
+            record.runTime = valid ? nanoseconds(Clock::now() - compiled) : 0;
+            record.valid = valid;
+            capture->write(record);
+        }
+        if(metrics) {
+            std::ofstream os(metrics);
+            writePrometheus(os, vm.getStats());
         }
         std::cout << ">>";
     }
@@ -0,0 +1,479 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Benchmarks of the frontend and VM hot paths. Every benchmark takes
+// several samples and reports the mean time per operation with its
+// standard deviation, so that optimizations can be measured against a
+// baseline:
+//     formula_bench                   run all benchmarks
+//     formula_bench -n 20 vm.         20 samples of benchmarks named vm.*
+//     formula_bench -o base.json      also write the results as JSON
+// Operations are scripts for the frontend and executed codes for the VM.
+// What the parser and the VM print is discarded while measuring.
+
+#include "Function.h"
+#include "Parse.h"
+#include "VM.h"
+#include "Profiler.h"
+#include "parser.h"
+#include "lexer.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::string;
+
+int yyparse(Function *function, void *scanner);
+
+// Default count of samples of each benchmark
+#define BENCH_SAMPLES 10
+
+// Workloads of the VM, derived from the programs in examples/
+
+// statement/forstmt-ascend and statement/while-stmt
+static const char *loopScript =
+    "s = 0\n"
+    "for i = 1, 20000 do\n"
+    "    s = s + i\n"
+    "end\n"
+    "n = 0\n"
+    "while n < 20000 do\n"
+    "    n = n + 1\n"
+    "end\n";
+
+static const char *arithmeticScript =
+    "x = 1.5\n"
+    "y = 0\n"
+    "for i = 1, 20000 do\n"
+    "    y = y + x * i - i / 3 + (i - x) * (i + x)\n"
+    "end\n";
+
+// function/func-with-params. The callee reads a number through an
+// upvalue and its local is bound twice, so calls are neither memoized
+// nor inlined.
+static const char *callScript =
+    "k = 1\n"
+    "add = 0\n"
+    "add = function(a, b) return a + b + k end\n"
+    "s = 0\n"
+    "for i = 1, 5000 do\n"
+    "    s = add(s, i)\n"
+    "end\n";
+
+// Recursion through an upvalue, impure like callScript
+static const char *recursionScript =
+    "one = 1\n"
+    "function fib(n)\n"
+    "    if n < 2 then\n"
+    "        return n\n"
+    "    end\n"
+    "    return fib(n - one) + fib(n - 2)\n"
+    "end\n"
+    "r = fib(16)\n";
+
+// Pure recursion, answered by the memo table after the first call
+static const char *memoScript =
+    "function fib(n)\n"
+    "    if n < 2 then\n"
+    "        return n\n"
+    "    end\n"
+    "    return fib(n - 1) + fib(n - 2)\n"
+    "end\n"
+    "r = 0\n"
+    "for i = 1, 2000 do\n"
+    "    r = r + fib(20)\n"
+    "end\n";
+
+// closure/closed_upvalue: a closure and a closed upvalue per iteration
+static const char *closureScript =
+    "function add(x)\n"
+    "    return function(y) return x + y end\n"
+    "end\n"
+    "s = 0\n"
+    "for i = 1, 3000 do\n"
+    "    add2 = add(i)\n"
+    "    s = s + add2(6)\n"
+    "end\n";
+
+static const char *arrayScript =
+    "a = array(1000, 1)\n"
+    "s = 0\n"
+    "for r = 1, 10 do\n"
+    "    for i = 1, len(a) do\n"
+    "        a[i] = a[i] + i\n"
+    "        s = s + a[i]\n"
+    "    end\n"
+    "end\n";
+
+// Generated script of n functions with loops and branches, the first
+// ncalls of them are called
+static string largeScript(int n, int ncalls)
+{
+    std::ostringstream os;
+    for(int i = 0; i < n; ++i) {
+        os << "function f" << i << "(a, b)\n"
+           << "    s = 0\n"
+           << "    for i = 1, b do\n"
+           << "        s = s + a * i - (a + i) / 2\n"
+           << "        if s > 1000 then\n"
+           << "            s = s - 1000\n"
+           << "        end\n"
+           << "    end\n"
+           << "    return s\n"
+           << "end\n";
+        if(i < ncalls)
+            os << "x" << i << " = f" << i << "(" << i << ", 10)\n";
+    }
+    return os.str();
+}
+
+// Generated script of n assignments of numeric literals
+static string numberScript(int n)
+{
+    std::ostringstream os;
+    for(int i = 0; i < n; ++i)
+        os << "x" << i % 100 << " = " << i * 7919 << " + " << i << ".5 * 2.718281828 - "
+           << i % 977 << "e-3 / 1.5E+2\n";
+    return os.str();
+}
+
+// Discard what the parser and the VM print
+class Quiet {
+public:
+    Quiet() {
+        std::cout.setstate(std::ios_base::badbit);
+    }
+    ~Quiet() {
+        std::cout.clear();
+    }
+};
+
+typedef std::chrono::steady_clock Clock;
+
+struct Result {
+    string name;
+    string unit;
+    // Nanoseconds per operation of each sample
+    std::vector<double> samples;
+    // Source bytes per operation, zero for the VM
+    double bytes;
+
+    double mean() const {
+        double sum = 0;
+        for(auto s : samples)
+            sum += s;
+        return sum / samples.size();
+    }
+
+    double stddev() const {
+        if(samples.size() < 2)
+            return 0;
+        double m = mean(), sum = 0;
+        for(auto s : samples)
+            sum += (s - m) * (s - m);
+        return std::sqrt(sum / (samples.size() - 1));
+    }
+
+    double min() const {
+        double m = samples[0];
+        for(auto s : samples)
+            if(s < m)
+                m = s;
+        return m;
+    }
+};
+
+static double elapsed(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// Count of tokens of the buffer scanner reads
+static int tokens(yyscan_t scanner)
+{
+    YYSTYPE value;
+    YYLTYPE location;
+    int n = 0;
+    while(yylex(&value, &location, scanner))
+        ++n;
+    return n;
+}
+
+// Count of tokens of source
+static int lex(const string &source)
+{
+    yyscan_t scanner;
+    if(yylex_init(&scanner))
+        throw "Cannot initialize the lexer";
+    auto state = yy_scan_string(source.c_str(), scanner);
+    int n = tokens(scanner);
+    yy_delete_buffer(state, scanner);
+    yylex_destroy(scanner);
+    return n;
+}
+
+// Count of tokens of file path read through stdio
+static int lexFile(const string &path)
+{
+    FILE *fp = fopen(path.c_str(), "r");
+    yyscan_t scanner;
+    if(!fp || yylex_init(&scanner))
+        throw "Cannot open the script file";
+    auto state = yy_create_buffer(fp, YY_BUF_SIZE, scanner);
+    yy_switch_to_buffer(state, scanner);
+    int n = tokens(scanner);
+    yy_delete_buffer(state, scanner);
+    yylex_destroy(scanner);
+    fclose(fp);
+    return n;
+}
+
+// Count of tokens of file path scanned in place where it is mapped
+static int lexMapped(const string &path)
+{
+    MappedSource source(path.c_str());
+    yyscan_t scanner;
+    if(!source.isOpen() || yylex_init(&scanner))
+        throw "Cannot open the script file";
+    auto state = yy_scan_buffer(source.data(), source.size(), scanner);
+    int n = tokens(scanner);
+    yy_delete_buffer(state, scanner);
+    yylex_destroy(scanner);
+    return n;
+}
+
+// Parse and generate code without optimizing
+static bool generate(Function *function, const string &source)
+{
+    yyscan_t scanner;
+    if(yylex_init(&scanner))
+        return false;
+    auto state = yy_scan_string(source.c_str(), scanner);
+    bool ok = yyparse(function, scanner) == 0;
+    yy_delete_buffer(state, scanner);
+    yylex_destroy(scanner);
+    return ok;
+}
+
+class Bench {
+public:
+    Bench(int nsamples, const string &filter): nsamples(nsamples), filter(filter) {
+    }
+
+    // Frontend benchmark: fn handles each of the scripts once per
+    // repetition, the operation is one script
+    void frontend(const string &name, const std::vector<string> &scripts, int reps,
+                  const std::function<void(const string &)> &fn) {
+        if(!selected(name))
+            return;
+        Result result;
+        result.name = name;
+        result.unit = "ns/script";
+        result.bytes = 0;
+        for(auto &s : scripts)
+            result.bytes += s.size();
+        result.bytes /= scripts.size();
+
+        Quiet quiet;
+        for(int i = 0; i < nsamples; ++i) {
+            auto start = Clock::now();
+            for(int r = 0; r < reps; ++r)
+                for(auto &s : scripts)
+                    fn(s);
+            result.samples.push_back(elapsed(start) / (reps * scripts.size()));
+        }
+        results.push_back(result);
+    }
+
+    // VM benchmark: the compiled script, frozen if asked, is run once per
+    // sample, the operation is one executed code
+    void vm(const string &name, const char *script, bool frozen = false) {
+        if(!selected(name))
+            return;
+        Result result;
+        result.name = name;
+        result.unit = "ns/code";
+        result.bytes = 0;
+
+        Function function("main");
+        VM vm;
+        vm.setTracing(false);
+        Profiler profiler;
+        Quiet quiet;
+        if(!parse(&function, script)) {
+            std::cout.clear();
+            std::cerr << name << ": syntax error\n";
+            std::exit(1);
+        }
+        if(frozen)
+            function.freeze();
+        // Count the codes once, profiling is off while measuring
+        vm.setProfiler(&profiler);
+        vm.load(&function);
+        vm.run();
+        vm.setProfiler(nullptr);
+        double codes = profiler.instructionCount();
+
+        for(int i = 0; i < nsamples; ++i) {
+            vm.reset();
+            vm.load(&function);
+            auto start = Clock::now();
+            vm.run();
+            result.samples.push_back(elapsed(start) / codes);
+        }
+        results.push_back(result);
+    }
+
+    void report(ostream &os) const {
+        os << std::left << std::setw(22) << "benchmark" << std::setw(12) << "unit"
+           << std::right << std::setw(12) << "mean" << std::setw(12) << "stddev"
+           << std::setw(12) << "min" << std::setw(12) << "MB/s" << "\n";
+        os << std::fixed << std::setprecision(1);
+        for(auto &r : results) {
+            os << std::left << std::setw(22) << r.name << std::setw(12) << r.unit
+               << std::right << std::setw(12) << r.mean() << std::setw(12) << r.stddev()
+               << std::setw(12) << r.min();
+            if(r.bytes > 0)
+                os << std::setw(12) << r.bytes / r.mean() * 1e9 / (1 << 20);
+            os << "\n";
+        }
+    }
+
+    void writeJson(ostream &os) const {
+        os << "{\n  \"samples\": " << nsamples << ",\n  \"benchmarks\": [\n";
+        for(std::size_t i = 0; i < results.size(); ++i) {
+            auto &r = results[i];
+            os << "    {\"name\": \"" << r.name << "\", \"unit\": \"" << r.unit
+               << "\", \"mean\": " << r.mean() << ", \"stddev\": " << r.stddev()
+               << ", \"min\": " << r.min();
+            if(r.bytes > 0)
+                os << ", \"bytes\": " << r.bytes;
+            os << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        os << "  ]\n}\n";
+    }
+
+private:
+    bool selected(const string &name) const {
+        return name.find(filter) != string::npos;
+    }
+
+    int nsamples;
+    string filter;
+    std::vector<Result> results;
+};
+
+int main(int argc, char *argv[])
+{
+    int nsamples = BENCH_SAMPLES;
+    const char *output = nullptr;
+    string filter;
+    for(int i = 1; i < argc; ++i) {
+        if(!std::strcmp(argv[i], "-n") && i + 1 < argc)
+            nsamples = std::atoi(argv[++i]);
+        else if(!std::strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else
+            filter = argv[i];
+    }
+    if(nsamples < 1)
+        nsamples = 1;
+
+    std::vector<string> examples = {
+        loopScript, arithmeticScript, callScript, recursionScript,
+        memoScript, closureScript, arrayScript
+    };
+    std::vector<string> large = { largeScript(500, 500) };
+    std::vector<string> library = { largeScript(500, 5) };
+    std::vector<string> numbers = { numberScript(20000) };
+
+    // The large script as a file, for the lexers reading files
+    const char *tmpdir = std::getenv("TMPDIR");
+    string path = string(tmpdir ? tmpdir : "/tmp") + "/formula_bench.fm";
+    {
+        std::ofstream os(path);
+        os << large[0];
+    }
+
+    Bench bench(nsamples, filter);
+    bench.frontend("lex.examples", examples, 200, [](const string &s) {
+        lex(s);
+    });
+    bench.frontend("parse.examples", examples, 50, [](const string &s) {
+        Function function("main");
+        generate(&function, s);
+    });
+    bench.frontend("compile.examples", examples, 50, [](const string &s) {
+        Function function("main");
+        parse(&function, s.c_str());
+    });
+    bench.frontend("lex.large", large, 5, [](const string &s) {
+        lex(s);
+    });
+    bench.frontend("lex.large.file", large, 5, [&path](const string &) {
+        lexFile(path);
+    });
+    bench.frontend("lex.large.mapped", large, 5, [&path](const string &) {
+        lexMapped(path);
+    });
+    bench.frontend("lex.numbers", numbers, 2, [](const string &s) {
+        lex(s);
+    });
+    bench.frontend("codegen.large", large, 2, [](const string &s) {
+        Function function("main");
+        generate(&function, s);
+    });
+    bench.frontend("compile.large", large, 1, [](const string &s) {
+        Function function("main");
+        parse(&function, s.c_str());
+    });
+    bench.frontend("compile.library", library, 1, [](const string &s) {
+        Function function("main");
+        parse(&function, s.c_str());
+    });
+    bench.frontend("compile.library.lazy", library, 1, [](const string &s) {
+        Function function("main");
+        function.setLazy(true);
+        parse(&function, s.c_str());
+    });
+
+    std::remove(path.c_str());
+
+    bench.vm("vm.loop", loopScript);
+    bench.vm("vm.arithmetic", arithmeticScript);
+    bench.vm("vm.call", callScript);
+    bench.vm("vm.recursion", recursionScript);
+    bench.vm("vm.memo", memoScript);
+    bench.vm("vm.closure", closureScript);
+    bench.vm("vm.call.frozen", callScript, true);
+    bench.vm("vm.closure.frozen", closureScript, true);
+    bench.vm("vm.array", arrayScript);
+
+    bench.report(std::cout);
+    if(output) {
+        std::ofstream os(output);
+        bench.writeJson(os);
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Replay a workload captured by formula-cli -c against the current build
+// and report throughput and latency percentiles, e.g.
+//     formula-cli -c work.cap < session.txt
+//     formula-replay -n 5 work.cap
+// Like in the interpreter session, programs are compiled into one main
+// function and run by one VM, so later programs see the variables of
+// earlier ones. The whole session is replayed REPEAT times, one time by
+// default. Compile and run times are compared with the captured ones, and
+// programs whose compiled size changed are counted. What the programs
+// print is discarded.
+
+#include "Capture.h"
+#include "Function.h"
+#include "Parse.h"
+#include "VM.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// Nearest rank percentile p of sorted samples
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if(sorted.empty())
+        return 0;
+    std::size_t rank = static_cast<std::size_t>(p / 100 * sorted.size() + 0.5);
+    if(rank > 0)
+        --rank;
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+static void printLatency(const char *name, std::vector<double> &samples)
+{
+    std::sort(samples.begin(), samples.end());
+    std::cout << std::left << std::setw(10) << name << std::right;
+    for(double p : {50.0, 90.0, 99.0, 100.0})
+        std::cout << std::setw(14) << percentile(samples, p) / 1000;
+    std::cout << "\n";
+}
+
+int main(int argc, char *argv[])
+{
+    int repeat = 1;
+    const char *path = nullptr;
+    for(int i = 1; i < argc; ++i) {
+        if(!std::strcmp(argv[i], "-n") && i + 1 < argc)
+            repeat = std::atoi(argv[++i]);
+        else
+            path = argv[i];
+    }
+    if(!path) {
+        std::cerr << "usage: formula-replay [-n REPEAT] CAPTURE\n";
+        return 1;
+    }
+    if(repeat < 1)
+        repeat = 1;
+
+    std::vector<CaptureRecord> records;
+    int errors = 0;
+    try {
+        CaptureReader reader(path);
+        CaptureRecord record;
+        while(reader.next(record)) {
+            records.push_back(record);
+            errors += !record.valid;
+        }
+    }
+    catch(const char *msg) {
+        std::cerr << msg << ": " << path << std::endl;
+        return 1;
+    }
+
+    std::vector<double> compileTimes, runTimes, totalTimes;
+    double capturedTime = 0, replayedTime = 0;
+    int invalid = 0, resized = 0;
+    auto start = Clock::now();
+
+    std::cout.setstate(std::ios_base::badbit);
+    for(int i = 0; i < repeat; ++i) {
+        Function function("main");
+        VM vm;
+        // Time dispatch rather than the per-code trace
+        vm.setTracing(false);
+        for(auto &record : records) {
+            if(!record.valid)
+                continue;
+            function.clearCodes();
+            std::size_t children = function.childCount();
+            auto compile = Clock::now();
+            if(!parse(&function, record.source.c_str())) {
+                invalid += i == 0;
+                continue;
+            }
+            double compileTime = elapsed(compile);
+            if(i == 0 && compiledSize(&function, children) != record.codes)
+                ++resized;
+
+            auto run = Clock::now();
+            vm.load(&function);
+            vm.run();
+            double runTime = elapsed(run);
+
+            compileTimes.push_back(compileTime);
+            runTimes.push_back(runTime);
+            totalTimes.push_back(compileTime + runTime);
+            capturedTime += record.compileTime + record.runTime;
+            replayedTime += compileTime + runTime;
+        }
+    }
+    double wall = elapsed(start);
+    std::cout.clear();
+
+    std::cout << records.size() << " programs captured, " << totalTimes.size()
+              << " runs replayed";
+    if(errors)
+        std::cout << ", " << errors << " with syntax errors";
+    if(invalid)
+        std::cout << ", " << invalid << " no longer compiled";
+    if(resized)
+        std::cout << ", " << resized << " compiled to a different size";
+    std::cout << "\n" << std::fixed << std::setprecision(1);
+    std::cout << "throughput " << totalTimes.size() / wall * 1e9 << " runs/s\n";
+    if(replayedTime > 0)
+        std::cout << "captured/replayed time " << std::setprecision(2)
+                  << capturedTime / replayedTime << std::setprecision(1) << "\n";
+
+    std::cout << "\n" << std::left << std::setw(10) << "latency" << std::right;
+    for(auto p : {"p50 us", "p90 us", "p99 us", "max us"})
+        std::cout << std::setw(14) << p;
+    std::cout << "\n";
+    printLatency("compile", compileTimes);
+    printLatency("run", runTimes);
+    printLatency("total", totalTimes);
+    return 0;
+}
@@ -0,0 +1,78 @@
+// Copyright (C) 2015-2016, kylinsage <kylinsage@gmail.com>
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// Report the opcode pairs executed most often, as candidates for
+// superinstructions. The input is the execution trace formula-cli prints
+// for each instruction ("OP:NAME ..." lines), e.g.
+//     echo script | formula-cli | formula-pairs 20
+// Pairs starting with CALL or RETURN cross functions and are not counted.
+
+#include "Code.h"
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <cstdlib>
+
+using std::string;
+
+// Opcode with the name printed in traces, Nop if unknown
+static Code::OpCode opcode(const string &name)
+{
+    for(std::size_t i = 0; i < sizeof(opdesc) / sizeof(opdesc[0]); ++i)
+        if(opdesc[i] == name)
+            return static_cast<Code::OpCode>(i);
+    return Code::Nop;
+}
+
+int main(int argc, char *argv[])
+{
+    int limit = argc > 1 ? std::atoi(argv[1]) : 20;
+
+    std::map<std::pair<Code::OpCode, Code::OpCode>, long> pairs;
+    long total = 0;
+    Code::OpCode prev = Code::Nop;
+    string line;
+    while(std::getline(std::cin, line)) {
+        if(line.compare(0, 3, "OP:") != 0)
+            continue;
+        auto op = opcode(line.substr(3, line.find('\t') - 3));
+        ++total;
+        if(prev != Code::Nop && prev != Code::Call && prev != Code::Return)
+            ++pairs[std::make_pair(prev, op)];
+        prev = op;
+    }
+
+    std::vector<std::pair<long, std::pair<Code::OpCode, Code::OpCode>>> sorted;
+    for(auto &p : pairs)
+        sorted.push_back(std::make_pair(p.second, p.first));
+    std::sort(sorted.rbegin(), sorted.rend());
+
+    std::cout << total << " instructions executed\n";
+    std::cout << "count\tshare\tpair\n";
+    for(int i = 0; i < (int)sorted.size() && i < limit; ++i) {
+        auto &p = sorted[i];
+        auto fused = Code::fused(p.second.first, p.second.second);
+        std::cout << p.first << "\t" << 100.0 * p.first / total << "%\t"
+                  << opdesc[p.second.first] << " " << opdesc[p.second.second];
+        if(fused != Code::Nop)
+            std::cout << "\t-> " << opdesc[fused];
+        std::cout << "\n";
+    }
+    return 0;
+}